@@ -1,10 +1,23 @@
 #include "../src/util.h"
+#include "../src/smt.h"
+#include "../src/tilecache.h"
+#include "../src/tilelru.h"
+#include "../src/tilesource.h"
+#include "../src/tiledimage.h"
+#include "../src/workqueue.h"
+#include "../src/dxt1.h"
+#include "../src/mipmap.h"
 #include "gtest/gtest.h"
 #include <OpenImageIO/imageio.h>
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
 #include <squish.h>
 #include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <sys/stat.h>
+#include <unistd.h>
 
 TEST( utils, valxval ){
     auto result = valxval( "123x456" );
@@ -51,6 +64,64 @@ TEST( utils, fix_channels ){
     ASSERT_EQ( outputBuf->spec().nchannels, 4 );
 }
 
+// solid_colour
+TEST( utils, solid_colour ){
+    OIIO_NAMESPACE_USING;
+
+    // the colour reported matches the pixels fix_channels makes of the tile
+    float values[] = { 0.2f, 0.6f };
+    for( int nchannels = 1; nchannels <= 2; ++nchannels ){
+        ImageSpec spec( 32, 32, nchannels, TypeDesc::UINT8 );
+        std::unique_ptr< ImageBuf > buf( new ImageBuf( spec ) );
+        ImageBufAlgo::fill( *buf, values );
+        uint8_t rgba[ 4 ];
+        ASSERT_TRUE( solid_colour( *buf, rgba ) );
+
+        buf = fix_channels( std::move( buf ), ImageSpec( 32, 32, 4, TypeDesc::UINT8 ) );
+        uint8_t pixel[ 4 ];
+        buf->get_pixels( 5, 6, 5, 6, 0, 1, TypeDesc::UINT8, pixel );
+        ASSERT_EQ( memcmp( rgba, pixel, 4 ), 0 );
+    }
+}
+
+// blit
+TEST( utils, blit ){
+    // a 3x2 window of 16 bit pixels from a 4x4 source into a 5x5 target
+    std::vector< uint16_t > src( 16 ), dst( 25, 0xffff );
+    for( int i = 0; i < 16; ++i ) src[ i ] = i;
+    blit( (const uint8_t *)&src[ 5 ], 8, (uint8_t *)&dst[ 6 ], 10, 6, 2 );
+    ASSERT_EQ( dst[ 5 ], 0xffff );
+    ASSERT_EQ( dst[ 6 ], 5 );
+    ASSERT_EQ( dst[ 8 ], 7 );
+    ASSERT_EQ( dst[ 9 ], 0xffff );
+    ASSERT_EQ( dst[ 11 ], 9 );
+    ASSERT_EQ( dst[ 16 ], 0xffff );
+
+    // a null source clears the window
+    blit( nullptr, 0, (uint8_t *)&dst[ 6 ], 10, 6, 2 );
+    ASSERT_EQ( dst[ 6 ], 0 );
+    ASSERT_EQ( dst[ 13 ], 0 );
+    ASSERT_EQ( dst[ 9 ], 0xffff );
+}
+
+// hash128
+TEST( utils, hash128 ){
+    std::vector< uint8_t > data( 4096 + 7 );
+    for( size_t i = 0; i < data.size(); ++i ) data[ i ] = i * 31;
+
+    // every length, including a partial final stripe, and each single bit
+    // flip gives a different hash.
+    Hash128 h = hash128( data.data(), data.size() );
+    ASSERT_EQ( h, hash128( data.data(), data.size() ) );
+    ASSERT_NE( h, hash128( data.data(), data.size() - 1 ) );
+    ASSERT_NE( h, hash128( data.data(), data.size(), 1 ) );
+    for( size_t i = 0; i < data.size(); i += 97 ){
+        data[ i ] ^= 1;
+        ASSERT_NE( h, hash128( data.data(), data.size() ) );
+        data[ i ] ^= 1;
+    }
+}
+
 // fix_scale
 TEST( utils, fix_scale ){
     OIIO_NAMESPACE_USING;
@@ -169,6 +240,814 @@ TEST( squish, DXT1CompressImage_ImageBuf_gradient )
 }
 
 
+TEST( dxt1, decodeMatchesSquish )
+{
+    // random blocks cover both the four and three colour modes
+    uint32_t width = 32;
+    uint32_t height = 32;
+    std::vector< uint8_t > blocks( width * height / 2 );
+    for( auto &i : blocks ) i = rand();
+
+    std::vector< uint8_t > expected( width * height * 4 );
+    std::vector< uint8_t > actual( width * height * 4 );
+    squish::DecompressImage( expected.data(), width, height,
+            blocks.data(), squish::kDxt1 );
+    decodeDXT1( blocks.data(), width, height, actual.data() );
+
+    ASSERT_TRUE( expected == actual );
+}
+
+TEST( dxt1, solidDXT1 )
+{
+    // never worse than squish's own single colour fit
+    for( int i = 0; i < 256; ++i ){
+        uint8_t colour[ 4 ] = { (uint8_t)i, (uint8_t)(255 - i),
+            (uint8_t)(i * 7), 255 };
+        std::vector< uint8_t > pixels( 16 * 4 );
+        for( int p = 0; p < 16; ++p ) memcpy( &pixels[ p * 4 ], colour, 4 );
+        ASSERT_TRUE( isSolidRGBA8( pixels.data(), 16 ) );
+
+        uint8_t expected[ 8 ], actual[ 8 ];
+        squish::Compress( pixels.data(), expected, squish::kDxt1 );
+        solidDXT1( colour, actual );
+
+        std::vector< uint8_t > a( 16 * 4 ), b( 16 * 4 );
+        decodeDXT1( expected, 4, 4, a.data() );
+        decodeDXT1( actual, 4, 4, b.data() );
+        int squishError = 0, solidError = 0;
+        for( int c = 0; c < 4; ++c ){
+            squishError += abs( a[ c ] - colour[ c ] );
+            solidError += abs( b[ c ] - colour[ c ] );
+        }
+        ASSERT_LE( solidError, squishError );
+    }
+}
+
+TEST( dxt1, classifyRGBA8 )
+{
+    std::vector< uint8_t > pixels( 32 * 32 * 4, 128 );
+    ASSERT_EQ( classifyRGBA8( pixels.data(), 32, 32 ), DXT1_FLAT );
+
+    // a shallow ramp across the tile
+    for( int i = 0; i < 32 * 32; ++i ){
+        for( int c = 0; c < 3; ++c ) pixels[ i * 4 + c ] = 100 + (i % 32);
+    }
+    ASSERT_EQ( classifyRGBA8( pixels.data(), 32, 32 ), DXT1_SMOOTH );
+
+    for( auto &i : pixels ) i = rand();
+    ASSERT_EQ( classifyRGBA8( pixels.data(), 32, 32 ), DXT1_DETAILED );
+}
+
+TEST( mipmap, buildMipChainRGBA8 )
+{
+    // 8x8 image of 2x2 checks, every level below the first is grey
+    std::vector< uint8_t > chain( mipChainBytes( 8, 8, 4, 4 ) );
+    ASSERT_EQ( chain.size(), (size_t)(64 + 16 + 4 + 1) * 4 );
+    for( int i = 0; i < 64; ++i ){
+        uint8_t value = ((i % 8) / 2 + (i / 16)) % 2 ? 255 : 0;
+        for( int c = 0; c < 4; ++c ) chain[ i * 4 + c ] = value;
+    }
+    buildMipChainRGBA8( chain.data(), 8, 8, 4 );
+
+    // first mip keeps the checks, each 2x2 block being one colour
+    ASSERT_EQ( chain[ 64 * 4 ], 0 );
+    ASSERT_EQ( chain[ 64 * 4 + 4 ], 255 );
+    for( size_t i = (64 + 16) * 4; i < chain.size(); ++i ){
+        ASSERT_EQ( chain[ i ], 128 );
+    }
+}
+
+// SMT
+// ===
+static std::string
+readFile( const std::string &fileName )
+{
+    std::ifstream file( fileName, std::ios::binary );
+    return std::string( std::istreambuf_iterator< char >( file ),
+                        std::istreambuf_iterator< char >() );
+}
+
+TEST( SMT, writeSession )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    OpenImageIO::ImageBuf buf( spec );
+    float R[4] = { 1, 0, 0, 1 };
+    float B[4] = { 0, 0, 1, 1 };
+    OpenImageIO::ImageBufAlgo::fill( buf, R, B );
+
+    // tiles appended one at a time
+    std::unique_ptr< SMT > direct( SMT::create( "test_direct.smt", true ) );
+    for( int i = 0; i < 3; ++i ) direct->append( buf );
+
+    // tiles appended inside a writer session, reserving more than is used
+    std::unique_ptr< SMT > session( SMT::create( "test_session.smt", true ) );
+    session->beginWrite( 16 );
+    for( int i = 0; i < 3; ++i ) session->append( buf );
+    session->endWrite();
+
+    ASSERT_EQ( session->nTiles, 3u );
+    std::string a = readFile( "test_direct.smt" );
+    std::string b = readFile( "test_session.smt" );
+    ASSERT_EQ( a.size(), sizeof( SMT::Header ) + 3 * 680 );
+    ASSERT_TRUE( a == b );
+}
+TEST( SMT, encodeConcurrently )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    std::vector< std::unique_ptr< OpenImageIO::ImageBuf > > batch;
+    for( int i = 0; i < 9; ++i ){
+        batch.emplace_back( new OpenImageIO::ImageBuf( spec ) );
+        float top[4] = { i / 9.0f, 0, 1, 1 };
+        float bottom[4] = { 0, 1 - i / 9.0f, 0, 1 };
+        OpenImageIO::ImageBufAlgo::fill( *batch.back(), top, bottom );
+    }
+
+    std::unique_ptr< SMT > serial( SMT::create( "test_serial.smt", true ) );
+    for( auto &buf : batch ) serial->append( *buf );
+
+    // tiles encoded on several threads and appended in order, as
+    // smt_convert does, come out the same as appending them one at a time
+    std::unique_ptr< SMT > parallel( SMT::create( "test_batch.smt", true ) );
+    std::vector< uint8_t > tiles( 680 * batch.size() );
+    std::vector< DXT1Class > classes( batch.size() );
+    std::atomic< size_t > next( 0 );
+    std::vector< std::thread > threads;
+    for( int t = 0; t < 4; ++t ){
+        threads.emplace_back( [&](){
+            for( size_t i = next++; i < batch.size(); i = next++ ){
+                parallel->encode( *batch[ i ], tiles.data() + 680 * i, &classes[ i ] );
+            }
+        } );
+    }
+    for( auto &thread : threads ) thread.join();
+    for( size_t i = 0; i < batch.size(); ++i ){
+        parallel->appendRaw( tiles.data() + 680 * i, classes[ i ] );
+    }
+
+    ASSERT_EQ( parallel->nTiles, 9u );
+    ASSERT_TRUE( readFile( "test_serial.smt" ) == readFile( "test_batch.smt" ) );
+
+    // classes are counted as tiles are written, not as they are encoded
+    auto counted = [&](){
+        uint64_t sum = 0;
+        for( int c = 0; c < DXT1_NCLASSES; ++c ) sum += parallel->classCount( (DXT1Class)c );
+        return sum;
+    };
+    ASSERT_EQ( counted(), 9u );
+    std::vector< uint8_t > tile( parallel->tileBytes );
+    DXT1Class dxt1Class;
+    ASSERT_TRUE( parallel->encode( *batch[ 0 ], tile.data(), &dxt1Class ) );
+    ASSERT_EQ( counted(), 9u );
+    parallel->appendRaw( tile.data(), dxt1Class );
+    ASSERT_EQ( counted(), 10u );
+}
+
+TEST( SMT, uncompressedRoundTrip )
+{
+    // both uncompressed formats must read back exactly what was written
+    struct { uint32_t type; int channels; OpenImageIO::TypeDesc format; }
+    formats[] = {
+        { GL_RGBA8, 4, OpenImageIO::TypeDesc::UINT8 },
+        { GL_UNSIGNED_SHORT, 1, OpenImageIO::TypeDesc::UINT16 } };
+
+    for( auto &f : formats ){
+        OpenImageIO::ImageSpec spec( 32, 32, f.channels, f.format );
+        OpenImageIO::ImageBuf buf( spec );
+        float top[4] = { 0.25, 0.5, 0.75, 1 };
+        float bottom[4] = { 1, 0.5, 0, 1 };
+        OpenImageIO::ImageBufAlgo::fill( buf, top, bottom );
+
+        std::unique_ptr< SMT > smt( SMT::create( "test_uncompressed.smt", true ) );
+        smt->setType( f.type );
+        smt->append( buf );
+        smt->append( buf );
+        ASSERT_EQ( smt->tileBytes,
+                (uint32_t)mipChainBytes( 32, 32, 4, spec.pixel_bytes() ) );
+
+        std::vector< uint8_t > expected( spec.image_bytes() );
+        std::vector< uint8_t > actual( spec.image_bytes() );
+        buf.get_pixels( 0, 32, 0, 32, 0, 1, f.format, expected.data() );
+        std::unique_ptr< OpenImageIO::ImageBuf > tile( smt->getTile( 1 ) );
+        ASSERT_TRUE( tile );
+        tile->get_pixels( 0, 32, 0, 32, 0, 1, f.format, actual.data() );
+        ASSERT_TRUE( expected == actual );
+
+        // getTile() hands out a copy that can be written to, leaving the
+        // mapping alone
+        ASSERT_TRUE( smt->mapFile() );
+        tile = smt->getTile( 1 );
+        ASSERT_TRUE( OpenImageIO::ImageBufAlgo::zero( *tile ) );
+        tile = smt->getTile( 1 );
+        tile->get_pixels( 0, 32, 0, 32, 0, 1, f.format, actual.data() );
+        ASSERT_TRUE( expected == actual );
+    }
+}
+
+TEST( SMT, sidecarIndex )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    OpenImageIO::ImageBuf buf( spec );
+    float grey[4] = { 0.5, 0.5, 0.5, 1 };
+    OpenImageIO::ImageBufAlgo::fill( buf, grey );
+
+    std::unique_ptr< SMT > smt( SMT::create( "test_index.smt", true ) );
+    smt->setIndexed( true );
+    smt->beginWrite();
+    for( int i = 0; i < 3; ++i ) smt->append( buf );
+    smt->endWrite();
+    ASSERT_EQ( smt->index.size(), 3u );
+    ASSERT_EQ( smt->index[ 0 ].hash, smt->index[ 2 ].hash );
+    ASSERT_NEAR( smt->index[ 0 ].mean[ 0 ], 0.5, 0.01 );
+    ASSERT_NEAR( smt->index[ 0 ].variance, 0, 1e-6 );
+
+    // read back with the file
+    std::unique_ptr< SMT > loaded( SMT::open( "test_index.smt" ) );
+    ASSERT_TRUE( loaded->isIndexed() );
+    ASSERT_EQ( loaded->index.size(), 3u );
+    ASSERT_EQ( loaded->index[ 1 ].hash, smt->index[ 1 ].hash );
+
+    // entries worked out ahead of the append are taken as given
+    const uint8_t *raw = loaded->getTileRaw( 0 );
+    std::vector< uint8_t > tile( raw, raw + loaded->tileBytes );
+    SMT::TileStats stats = loaded->tileStats( tile.data() );
+    ASSERT_EQ( stats.hash, smt->index[ 0 ].hash );
+    stats.reserved = 7;
+    loaded->appendRaw( tile.data(), DXT1_NCLASSES, &stats );
+    ASSERT_EQ( loaded->index.size(), 4u );
+    ASSERT_EQ( loaded->index[ 3 ].reserved, 7u );
+    loaded.reset();
+    smt.reset( SMT::open( "test_index.smt" ) );
+    ASSERT_TRUE( smt->isIndexed() );
+
+    // appending without the index leaves it stale
+    smt->setIndexed( false );
+    smt->append( buf );
+    loaded.reset( SMT::open( "test_index.smt" ) );
+    ASSERT_FALSE( loaded->isIndexed() );
+}
+
+TEST( SMT, verifyTile )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    OpenImageIO::ImageBuf buf( spec );
+    float R[4] = { 1, 0, 0, 1 };
+    float B[4] = { 0, 0, 1, 1 };
+    OpenImageIO::ImageBufAlgo::fill( buf, R, B );
+
+    std::unique_ptr< SMT > smt( SMT::create( "test_verify.smt", true ) );
+    // pure black encodes to nothing but zeros, which is reported and no more
+    std::vector< uint8_t > tile( smt->tileBytes );
+    ASSERT_EQ( smt->verifyTile( tile.data() ), (uint32_t)SMT::WARN_EMPTY );
+    const uint8_t black[ 4 ] = { 0, 0, 0, 255 };
+    ASSERT_TRUE( smt->encodeSolid( black, tile.data() ) );
+    ASSERT_EQ( smt->verifyTile( tile.data() ), (uint32_t)SMT::WARN_EMPTY );
+
+    ASSERT_TRUE( smt->encode( buf, tile.data() ) );
+    ASSERT_EQ( smt->verifyTile( tile.data() ), 0u );
+
+    // make the second mip solid white
+    const uint8_t white[ 8 ] = { 0xff, 0xff, 0, 0, 0, 0, 0, 0 };
+    for( uint32_t i = 512; i < 640; i += 8 ) memcpy( &tile[ i ], white, 8 );
+    ASSERT_EQ( smt->verifyTile( tile.data() ), (uint32_t)SMT::WARN_MIPS );
+
+    // transparent solid tiles are legitimate
+    const uint8_t clear[ 4 ] = { 0, 0, 0, 0 };
+    ASSERT_TRUE( smt->encodeSolid( clear, tile.data() ) );
+    ASSERT_EQ( smt->verifyTile( tile.data() ), (uint32_t)SMT::WARN_TRANSPARENT );
+}
+
+TEST( SMT, mappedReads )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    OpenImageIO::ImageBuf buf( spec );
+    std::unique_ptr< SMT > smt( SMT::create( "test_mapped.smt", true ) );
+    for( int i = 0; i < 3; ++i ){
+        float colour[4] = { i / 3.0f, 0.5, 1 - i / 3.0f, 1 };
+        OpenImageIO::ImageBufAlgo::fill( buf, colour );
+        smt->append( buf );
+    }
+
+    // tiles read through the mapping match the bytes on disk
+    std::string bytes = readFile( "test_mapped.smt" );
+    const char *tiles = bytes.data() + sizeof( SMT::Header );
+    smt.reset( SMT::open( "test_mapped.smt" ) );
+    ASSERT_TRUE( smt->mapFile() );
+    for( uint32_t n = 0; n < 3; ++n ){
+        ASSERT_EQ( memcmp( smt->getTileRaw( n ), tiles + 680 * n, 680 ), 0 );
+    }
+    smt.reset();
+
+    // cut halfway through the second tile, what is left of it is read and
+    // the rest is zero
+    ASSERT_EQ( truncate( "test_mapped.smt", sizeof( SMT::Header ) + 680 + 340 ), 0 );
+    smt.reset( SMT::open( "test_mapped.smt" ) );
+    ASSERT_EQ( smt->nTiles, 3u );
+    std::vector< uint8_t > partial( 680, 0 ), zero( 680, 0 );
+    memcpy( partial.data(), tiles + 680, 340 );
+    ASSERT_EQ( memcmp( smt->getTileRaw( 0 ), tiles, 680 ), 0 );
+    ASSERT_EQ( memcmp( smt->getTileRaw( 1 ), partial.data(), 680 ), 0 );
+    ASSERT_EQ( memcmp( smt->getTileRaw( 2 ), zero.data(), 680 ), 0 );
+    ASSERT_TRUE( smt->getTile( 2 ) );
+
+    // nothing is mapped during a write session, so reads go to the file
+    smt->beginWrite();
+    ASSERT_EQ( memcmp( smt->getTileRaw( 0 ), tiles, 680 ), 0 );
+    ASSERT_EQ( memcmp( smt->getTileRaw( 1 ), partial.data(), 680 ), 0 );
+    ASSERT_EQ( memcmp( smt->getTileRaw( 2 ), zero.data(), 680 ), 0 );
+
+    // tiles appended in the session are read back from the write buffer
+    smt->appendRaw( (const uint8_t *)tiles );
+    ASSERT_EQ( smt->nTiles, 4u );
+    ASSERT_EQ( memcmp( smt->getTileRaw( 3 ), tiles, 680 ), 0 );
+    std::vector< uint8_t > pixels = smt->getTiles( 3, 1 );
+    ASSERT_EQ( pixels, smt->getTiles( 0, 1 ) );
+    smt->endWrite();
+}
+
+TEST( SMT, appendRaw )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    {
+        std::unique_ptr< SMT > smt( SMT::create( "test_raw_in.smt", true ) );
+        for( int i = 0; i < 3; ++i ){
+            OpenImageIO::ImageBuf buf( spec );
+            float top[4] = { i / 3.0f, 0, 1, 1 };
+            float bottom[4] = { 0, 1, i / 3.0f, 1 };
+            OpenImageIO::ImageBufAlgo::fill( buf, top, bottom );
+            smt->append( buf );
+        }
+    }
+
+    // encoded tiles copied from one file to another without decoding them,
+    // as smt_convert passes tiles through, come out byte for byte the same
+    std::unique_ptr< SMT > in( SMT::open( "test_raw_in.smt" ) );
+    std::unique_ptr< SMT > out( SMT::create( "test_raw_out.smt", true ) );
+    out->beginWrite();
+    for( uint32_t n = 0; n < in->nTiles; ++n ) out->appendRaw( in->getTileRaw( n ) );
+    out->endWrite();
+    ASSERT_EQ( out->nTiles, 3u );
+    ASSERT_TRUE( readFile( "test_raw_in.smt" ) == readFile( "test_raw_out.smt" ) );
+
+    std::unique_ptr< SMT > back( SMT::open( "test_raw_out.smt" ) );
+    for( uint32_t n = 0; n < 3; ++n ){
+        std::vector< uint8_t > expected( in->getTileRaw( n ), in->getTileRaw( n ) + 680 );
+        ASSERT_EQ( memcmp( back->getTileRaw( n ), expected.data(), 680 ), 0 );
+    }
+
+    // the same bytes are what a source hands on for passthrough
+    SMTSource source( SMT::open( "test_raw_in.smt" ) );
+    std::vector< uint8_t > blocks;
+    ASSERT_TRUE( source.getTileDXT1( 1, 32, blocks ) );
+    ASSERT_EQ( blocks.size(), 680u );
+    ASSERT_EQ( memcmp( blocks.data(), in->getTileRaw( 1 ), 680 ), 0 );
+    ASSERT_FALSE( source.getTileDXT1( 1, 64, blocks ) );
+}
+
+TEST( SMT, getTiles )
+{
+    // two files of eight tiles, each tile a different gradient
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    const char *fileNames[ 2 ] = { "test_gettiles_a.smt", "test_gettiles_b.smt" };
+    for( int f = 0; f < 2; ++f ){
+        std::unique_ptr< SMT > smt( SMT::create( fileNames[ f ], true ) );
+        for( int i = 0; i < 8; ++i ){
+            OpenImageIO::ImageBuf buf( spec );
+            float top[4] = { i / 8.0f, f * 0.5f, 1, 1 };
+            float bottom[4] = { 1, i / 8.0f, f * 0.5f, 1 };
+            OpenImageIO::ImageBufAlgo::fill( buf, top, bottom );
+            smt->append( buf );
+        }
+    }
+
+    // unsorted, with gaps and a repeat
+    std::vector< uint32_t > indices = { 5, 1, 2, 7, 2, 0, 6 };
+    size_t pixelBytes = spec.image_bytes();
+    std::unique_ptr< SMT > smt( SMT::open( fileNames[ 0 ] ) );
+    auto check = [&]( const std::vector< uint8_t > &tiles ){
+        ASSERT_EQ( tiles.size(), pixelBytes * indices.size() );
+        for( size_t k = 0; k < indices.size(); ++k ){
+            std::unique_ptr< OpenImageIO::ImageBuf > tile = smt->getTile( indices[ k ] );
+            ASSERT_EQ( memcmp( tiles.data() + pixelBytes * k,
+                        tile->localpixels(), pixelBytes ), 0 ) << "slot " << k;
+        }
+    };
+    ASSERT_TRUE( smt->mapFile() );
+    check( smt->getTiles( indices ) );
+
+    // nothing is mapped during a write session, so runs are read from the file
+    smt->beginWrite();
+    check( smt->getTiles( indices ) );
+    smt->endWrite();
+
+    // requests spanning both files are split between them and put back
+    // in order
+    TileCache cache;
+    cache.addSource( fileNames[ 0 ] );
+    cache.addSource( fileNames[ 1 ] );
+    indices = { 9, 2, 15, 0, 8, 9, 7 };
+    std::vector< uint8_t > tiles = cache.getTiles( indices, spec );
+    ASSERT_EQ( tiles.size(), pixelBytes * indices.size() );
+    std::vector< uint8_t > expected( pixelBytes );
+    for( size_t k = 0; k < indices.size(); ++k ){
+        cache.getTile( indices[ k ] )->get_pixels( 0, 32, 0, 32, 0, 1,
+                OpenImageIO::TypeDesc::UINT8, expected.data() );
+        ASSERT_EQ( memcmp( tiles.data() + pixelBytes * k, expected.data(),
+                    pixelBytes ), 0 ) << "slot " << k;
+    }
+}
+
+TEST( SMT, shortFile )
+{
+    // the magic alone passes test(), but there is no header to load
+    {
+        std::ofstream file( "test_short.smt", std::ios::binary );
+        file.write( SMT::Header().magic, 20 );
+    }
+    ASSERT_TRUE( SMT::test( "test_short.smt" ) );
+    ASSERT_TRUE( SMT::open( "test_short.smt" ) == nullptr );
+    ASSERT_FALSE( TileSource::open( "test_short.smt", nullptr ) );
+}
+
+TEST( SMT, largeFile )
+{
+    // needs over 4GiB of sparse file, which not every filesystem or
+    // machine running the tests can spare
+    if(! getenv( "SMF_TOOLS_LARGE_TESTS" ) ) return;
+
+    // a sparse uncompressed file of just over 4GiB, with a marked last tile
+    SMT::Header header;
+    header.tileType = GL_RGBA8;
+    const uint32_t tileBytes = mipChainBytes( 32, 32, 4, 4 );
+    header.nTiles = ((1ULL << 32) / tileBytes) + 2;
+    uint64_t lastOffset = sizeof( SMT::Header ) + (uint64_t)tileBytes * (header.nTiles - 1);
+    ASSERT_GT( lastOffset, 1ULL << 32 );
+
+    std::vector< uint8_t > marked( tileBytes );
+    for( uint32_t i = 0; i < tileBytes; ++i ) marked[ i ] = i * 7;
+    {
+        std::ofstream file( "test_large.smt", std::ios::binary );
+        file.write( (char *)&header, sizeof( header ) );
+        file.seekp( lastOffset );
+        file.write( (char *)marked.data(), tileBytes );
+        ASSERT_TRUE( file.good() );
+    }
+
+    std::unique_ptr< SMT > smt( SMT::open( "test_large.smt" ) );
+    ASSERT_EQ( smt->nTiles, header.nTiles );
+    ASSERT_EQ( smt->tileBytes, tileBytes );
+    ASSERT_EQ( memcmp( smt->getTileRaw( header.nTiles - 1 ), marked.data(), tileBytes ), 0 );
+
+    // batched reads either side of the 4GiB boundary
+    std::vector< uint8_t > tiles = smt->getTiles( { 0, header.nTiles - 1 } );
+    size_t pixelBytes = smt->tileSpec.image_bytes();
+    ASSERT_EQ( tiles[ 0 ], 0 );
+    ASSERT_EQ( memcmp( tiles.data() + pixelBytes, marked.data(), pixelBytes ), 0 );
+
+    // TileCache offsets the indices of later sources
+    TileCache cache;
+    cache.addSource( "test_large.smt" );
+    cache.addSource( "test_large.smt" );
+    ASSERT_EQ( cache.nTiles, header.nTiles * 2 );
+    std::vector< uint8_t > last = cache.getTiles( { cache.nTiles - 1 }, smt->tileSpec );
+    ASSERT_EQ( memcmp( last.data(), marked.data(), pixelBytes ), 0 );
+
+    smt.reset();
+    remove( "test_large.smt" );
+}
+
+TEST( TileLRU, budget )
+{
+    // 16 shards of 1KiB each
+    TileLRU lru( 16 * 1024 );
+    auto tile = std::make_shared< std::vector< uint8_t > >( 512, 1 );
+
+    ASSERT_TRUE( lru.find( 0, 1 ) == nullptr );
+    lru.insert( 0, 1, tile );
+    ASSERT_TRUE( lru.find( 0, 1 ) != nullptr );
+    ASSERT_TRUE( lru.find( 0, 2 ) == nullptr );
+
+    // keys 16 and 32 share a shard with 0, which is now the oldest
+    lru.find( 0, 1 );
+    lru.insert( 16, 1, tile );
+    lru.find( 0, 1 );
+    lru.insert( 32, 1, tile );
+    ASSERT_TRUE( lru.contains( 0, 1 ) );
+    ASSERT_FALSE( lru.contains( 16, 1 ) );
+    ASSERT_TRUE( lru.contains( 32, 1 ) );
+
+    TileLRU::Stats stats = lru.stats();
+    ASSERT_EQ( stats.hits, 3u );
+    ASSERT_EQ( stats.misses, 2u );
+    ASSERT_EQ( stats.evictions, 1u );
+    ASSERT_EQ( stats.bytes, 1024u );
+
+    lru.setBudget( 0 );
+    ASSERT_EQ( lru.stats().bytes, 0u );
+}
+
+TEST( TileCache, prefetch )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    OpenImageIO::ImageBuf buf( spec );
+    float R[4] = { 1, 0, 0, 1 };
+    float B[4] = { 0, 0, 1, 1 };
+    OpenImageIO::ImageBufAlgo::fill( buf, R, B );
+    std::unique_ptr< SMT > smt( SMT::create( "test_prefetch.smt", true ) );
+    for( int i = 0; i < 8; ++i ) smt->append( buf );
+    smt.reset();
+
+    TileCache cache;
+    cache.addSource( "test_prefetch.smt" );
+    cache.setPrefetchThreads( 2 );
+    std::vector< uint32_t > indices = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    cache.prefetch( indices, spec );
+
+    // wait for the background threads to fill the cache
+    for( int i = 0; i < 500 && cache.cacheStats().bytes < 8 * spec.image_bytes(); ++i ){
+        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+    }
+    std::vector< uint8_t > tiles = cache.getTiles( indices, spec );
+    ASSERT_EQ( cache.cacheStats().hits, 8u );
+    ASSERT_EQ( cache.cacheStats().misses, 0u );
+}
+
+TEST( TileCache, findSource )
+{
+    // three sources of 3, 1 and 2 tiles, each tile a distinct grey
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    const int counts[] = { 3, 1, 2 };
+    TileCache cache;
+    int tile = 0;
+    for( int i = 0; i < 3; ++i ){
+        std::string name = "test_source" + std::to_string( i ) + ".smt";
+        std::unique_ptr< SMT > smt( SMT::create( name, true ) );
+        smt->setType( GL_RGBA8 );
+        for( int k = 0; k < counts[ i ]; ++k, ++tile ){
+            OpenImageIO::ImageBuf buf( spec );
+            float grey[4] = { tile / 255.0f, tile / 255.0f, tile / 255.0f, 1 };
+            OpenImageIO::ImageBufAlgo::fill( buf, grey );
+            smt->append( buf );
+        }
+        smt.reset();
+        cache.addSource( name );
+    }
+    ASSERT_EQ( cache.nTiles, 6u );
+
+    std::vector< uint32_t > indices = { 5, 0, 3, 2, 4, 1 };
+    std::vector< uint8_t > tiles = cache.getTiles( indices, spec );
+    for( size_t k = 0; k < indices.size(); ++k ){
+        ASSERT_EQ( tiles[ k * spec.image_bytes() ], indices[ k ] );
+    }
+
+    // tiles from every source stay readable while others are read
+    std::unique_ptr< OpenImageIO::ImageBuf > first = cache.getTile( 0 );
+    for( uint32_t n : indices ){
+        std::unique_ptr< OpenImageIO::ImageBuf > buf = cache.getTile( n );
+        ASSERT_EQ( ((const uint8_t *)buf->localpixels())[ 0 ], n );
+    }
+    ASSERT_EQ( ((const uint8_t *)first->localpixels())[ 0 ], 0 );
+}
+
+TEST( TileCache, addSources )
+{
+    // a directory of two single tile smt files, and a manifest of them
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    mkdir( "test_sources", 0755 );
+    for( int i = 0; i < 2; ++i ){
+        std::string name = "test_sources/" + std::to_string( i ) + ".smt";
+        std::unique_ptr< SMT > smt( SMT::create( name, true ) );
+        smt->setType( GL_RGBA8 );
+        OpenImageIO::ImageBuf buf( spec );
+        float grey[4] = { i / 255.0f, i / 255.0f, i / 255.0f, 1 };
+        OpenImageIO::ImageBufAlgo::fill( buf, grey );
+        smt->append( buf );
+    }
+    std::ofstream( "test_sources.txt" ) << "# reversed\n"
+        "test_sources/1.smt\ntest_sources/0.smt\n";
+
+    TileCache dir;
+    dir.setProbeCache( "test_sources.probe" );
+    dir.addSources( { "test_sources" }, 2 );
+    ASSERT_EQ( dir.nTiles, 2u );
+
+    TileCache manifest;
+    manifest.addSources( { "@test_sources.txt" } );
+    ASSERT_EQ( manifest.nTiles, 2u );
+    std::vector< uint8_t > tiles = manifest.getTiles( { 0, 1 }, spec );
+    ASSERT_EQ( tiles[ 0 ], 1 );
+    ASSERT_EQ( tiles[ spec.image_bytes() ], 0 );
+
+    // the probe cache records both files
+    std::ifstream probes( "test_sources.probe" );
+    int lines = 0;
+    for( std::string line; std::getline( probes, line ); ){
+        if( line[ 0 ] != '#' ) ++lines;
+    }
+    ASSERT_EQ( lines, 2 );
+}
+
+TEST( TileCache, imageSource )
+{
+    OpenImageIO::ImageSpec spec( 64, 64, 4, OpenImageIO::TypeDesc::UINT8 );
+    OpenImageIO::ImageBuf image( spec );
+    float colour[4] = { 1, 0, 0, 1 };
+    OpenImageIO::ImageBufAlgo::fill( image, colour );
+    ASSERT_TRUE( image.write( "test_image.tif" ) );
+
+    TileCache cache;
+    cache.setImageCacheBytes( 16 << 20 );
+    cache.addSource( "test_image.tif" );
+    ASSERT_EQ( cache.nTiles, 1u );
+
+    // read as is through the image cache, and scaled down
+    std::vector< uint8_t > tile = cache.getTiles( { 0 }, spec );
+    ASSERT_EQ( tile[ 0 ], 255 );
+    ASSERT_EQ( tile[ spec.image_bytes() - 3 ], 0 );
+
+    OpenImageIO::ImageSpec half( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    tile = cache.getTiles( { 0 }, half );
+    ASSERT_EQ( tile.size(), half.image_bytes() );
+    ASSERT_EQ( tile[ 0 ], 255 );
+}
+
+TEST( TileSource, open )
+{
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    {
+        std::unique_ptr< SMT > smt( SMT::create( "test_tilesource.smt", true ) );
+        smt->setType( GL_RGBA8 );
+        for( int i = 0; i < 4; ++i ){
+            OpenImageIO::ImageBuf buf( spec );
+            float grey[4] = { i / 255.0f, i / 255.0f, i / 255.0f, 1 };
+            OpenImageIO::ImageBufAlgo::fill( buf, grey );
+            smt->append( buf );
+        }
+    }
+    std::ofstream( "test_tilesource.txt" ) << "not a tile source";
+
+    OpenImageIO::ImageCache *imageCache = OpenImageIO::ImageCache::create();
+    ASSERT_TRUE( TileSource::open( "test_tilesource.txt", imageCache ) == nullptr );
+    std::shared_ptr< TileSource > source =
+        TileSource::open( "test_tilesource.smt", imageCache );
+    ASSERT_TRUE( source != nullptr );
+    ASSERT_EQ( source->nTiles, 4u );
+
+    // every thread reads every tile through the one source
+    std::vector< std::thread > threads;
+    std::atomic< int > failures( 0 );
+    for( int t = 0; t < 4; ++t ){
+        threads.emplace_back( [&](){
+            std::vector< uint8_t > pixels( spec.image_bytes() * 4 );
+            uint8_t *dest[4];
+            for( int i = 0; i < 4; ++i ) dest[ i ] = &pixels[ spec.image_bytes() * i ];
+            if(! source->getTiles( { 3, 2, 1, 0 }, spec, dest ) ) ++failures;
+            for( int i = 0; i < 4; ++i ){
+                if( dest[ i ][ 0 ] != 3 - i ) ++failures;
+            }
+        } );
+    }
+    for( auto &thread : threads ) thread.join();
+    ASSERT_EQ( failures.load(), 0 );
+}
+
+TEST( TileSource, dds )
+{
+    // a minimal 32x32 dxt1 dds with a full mip chain
+    uint32_t header[ 32 ] = { 0 };
+    memcpy( &header[ 0 ], "DDS ", 4 );
+    header[ 1 ] = 124;          // header size
+    header[ 2 ] = 0x000a1007;   // caps, height, width, pixel format, mips, linear size
+    header[ 3 ] = 32;           // height
+    header[ 4 ] = 32;           // width
+    header[ 5 ] = 512;          // bytes of the first mip
+    header[ 7 ] = 6;            // mip count
+    header[ 19 ] = 32;          // pixel format size
+    header[ 20 ] = 4;           // fourcc flag
+    memcpy( &header[ 21 ], "DXT1", 4 );
+    header[ 27 ] = 0x00401008;  // complex, texture, mipmap
+
+    // 32, 16, 8, 4, 2 and 1 pixel mips
+    std::vector< uint8_t > blocks( 680 + 16 );
+    for( size_t i = 0; i < blocks.size(); ++i ) blocks[ i ] = i * 13;
+    auto writeDDS = [&]( const char *fileName, size_t bytes ){
+        std::ofstream file( fileName, std::ios::binary );
+        file.write( (char *)header, sizeof( header ) );
+        file.write( (char *)blocks.data(), bytes );
+    };
+    writeDDS( "test_tile.dds", blocks.size() );
+
+    // only the four mips an smt tile holds are read
+    ImageSource source( "test_tile.dds", nullptr );
+    std::vector< uint8_t > read;
+    ASSERT_TRUE( source.getTileDXT1( 0, 32, read ) );
+    ASSERT_EQ( read.size(), 680u );
+    ASSERT_EQ( memcmp( read.data(), blocks.data(), 680 ), 0 );
+    ASSERT_FALSE( source.getTileDXT1( 0, 64, read ) );
+
+    // the file is read once, later calls are served from memory
+    ASSERT_EQ( remove( "test_tile.dds" ), 0 );
+    ASSERT_TRUE( source.getTileDXT1( 0, 32, read ) );
+    ASSERT_EQ( memcmp( read.data(), blocks.data(), 680 ), 0 );
+
+    // too short, or not dxt1
+    writeDDS( "test_tile.dds", 600 );
+    ASSERT_FALSE( ImageSource( "test_tile.dds", nullptr ).getTileDXT1( 0, 32, read ) );
+    memcpy( &header[ 21 ], "DXT5", 4 );
+    writeDDS( "test_tile.dds", blocks.size() );
+    ASSERT_FALSE( ImageSource( "test_tile.dds", nullptr ).getTileDXT1( 0, 32, read ) );
+}
+
+TEST( TiledImage, getRegion )
+{
+    // a 2x2 map of tiles whose pixels hold their tile index
+    OpenImageIO::ImageSpec spec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
+    {
+        std::unique_ptr< SMT > smt( SMT::create( "test_tiledimage.smt", true ) );
+        smt->setType( GL_RGBA8 );
+        for( int i = 0; i < 4; ++i ){
+            OpenImageIO::ImageBuf buf( spec );
+            float grey[4] = { i / 255.0f, i / 255.0f, i / 255.0f, 1 };
+            OpenImageIO::ImageBufAlgo::fill( buf, grey );
+            smt->append( buf );
+        }
+    }
+    TiledImage image;
+    image.tileCache.addSource( "test_tiledimage.smt" );
+    image.setTSpec( spec );
+    image.squareFromCache();
+
+    // aligned to a single tile
+    std::unique_ptr< OpenImageIO::ImageBuf > region =
+        image.getRegion( OpenImageIO::ROI( 32, 64, 32, 64 ) );
+    const uint8_t *pixels = (const uint8_t *)region->localpixels();
+    ASSERT_EQ( region->spec().width, 32 );
+    ASSERT_EQ( pixels[ 0 ], 3 );
+    ASSERT_EQ( pixels[ spec.image_bytes() - 4 ], 3 );
+
+    // spanning all four
+    region = image.getRegion( OpenImageIO::ROI( 16, 48, 16, 48 ) );
+    pixels = (const uint8_t *)region->localpixels();
+    size_t row = 32 * 4;
+    ASSERT_EQ( pixels[ 0 ], 0 );
+    ASSERT_EQ( pixels[ 31 * 4 ], 1 );
+    ASSERT_EQ( pixels[ 31 * row ], 2 );
+    ASSERT_EQ( pixels[ 31 * row + 31 * 4 ], 3 );
+
+    // a buffer of the right size is reused, whichever path fills it, and
+    // aligned reads leave the decoded tile cache alone
+    OpenImageIO::ImageBuf reused;
+    image.getRegion( OpenImageIO::ROI( 16, 48, 16, 48 ), reused );
+    const void *memory = reused.localpixels();
+    TileLRU::Stats before = image.tileCache.cacheStats();
+    image.getRegion( OpenImageIO::ROI( 0, 32, 32, 64 ), reused );
+    ASSERT_EQ( reused.localpixels(), memory );
+    ASSERT_EQ( ((const uint8_t *)reused.localpixels())[ 0 ], 2 );
+    ASSERT_EQ( image.tileCache.cacheStats().bytes, before.bytes );
+
+    // at half size the tiles come from their stored mips
+    image.setLOD( 1 );
+    ASSERT_EQ( image.getWidth(), 32u );
+    region = image.getRegion( OpenImageIO::ROI( 16, 32, 0, 16 ) );
+    ASSERT_EQ( region->spec().width, 16 );
+    ASSERT_EQ( ((const uint8_t *)region->localpixels())[ 0 ], 1 );
+
+    SMT *smt = SMT::open( "test_tiledimage.smt" );
+    std::unique_ptr< OpenImageIO::ImageBuf > mip = smt->getTile( 2, 3 );
+    ASSERT_EQ( mip->spec().width, 4 );
+    ASSERT_EQ( ((const uint8_t *)mip->localpixels())[ 0 ], 2 );
+    delete smt;
+}
+
+TEST( WorkQueue, ordered )
+{
+    // pushed from several threads in any order, popped in sequence, with
+    // a capacity far smaller than the number of items.
+    const uint64_t count = 1000;
+    OrderedQueue< uint64_t > ordered( 4 );
+    WorkQueue< uint64_t > fifo( 4 );
+    std::atomic< uint64_t > next( 0 );
+    std::vector< std::thread > threads;
+    for( int i = 0; i < 4; ++i ){
+        threads.emplace_back( [&](){
+            for( uint64_t seq = next++; seq < count; seq = next++ ){
+                ordered.push( seq, seq * 2 );
+            }
+        } );
+    }
+    std::thread consumer( [&](){
+        for( uint64_t seq = 0; seq < count; ++seq ) fifo.push( ordered.pop() );
+        fifo.close();
+    } );
+
+    uint64_t expected = 0, value;
+    while( fifo.pop( value ) ){
+        EXPECT_EQ( value, expected );
+        expected += 2;
+    }
+    ASSERT_EQ( expected, count * 2 );
+    for( auto &thread : threads ) thread.join();
+    consumer.join();
+}
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
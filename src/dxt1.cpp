@@ -0,0 +1,286 @@
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#elif defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+#include <squish.h>
+
+#include "dxt1.h"
+
+// expand a 565 colour to RGBA8, packed little endian
+static inline uint32_t
+unpack565( uint32_t value, int &red, int &green, int &blue )
+{
+    red   = (value >> 11) & 0x1f;
+    green = (value >> 5 ) & 0x3f;
+    blue  =  value        & 0x1f;
+    red   = (red   << 3) | (red   >> 2);
+    green = (green << 2) | (green >> 4);
+    blue  = (blue  << 3) | (blue  >> 2);
+    return red | (green << 8) | (blue << 16) | 0xff000000u;
+}
+
+static inline uint32_t
+pack( int red, int green, int blue, uint32_t alpha )
+{
+    return red | (green << 8) | (blue << 16) | alpha;
+}
+
+// Build the four colour palette of a block, matching squish's arithmetic
+static inline void
+palette( const uint8_t *block, uint32_t *colours )
+{
+    uint32_t a = block[ 0 ] | (block[ 1 ] << 8);
+    uint32_t b = block[ 2 ] | (block[ 3 ] << 8);
+    int ar, ag, ab, br, bg, bb;
+    colours[ 0 ] = unpack565( a, ar, ag, ab );
+    colours[ 1 ] = unpack565( b, br, bg, bb );
+
+    if( a <= b ){
+        colours[ 2 ] = pack( (ar + br) / 2, (ag + bg) / 2, (ab + bb) / 2,
+                0xff000000u );
+        colours[ 3 ] = 0;
+    }
+    else {
+        colours[ 2 ] = pack( (2 * ar + br) / 3, (2 * ag + bg) / 3,
+                (2 * ab + bb) / 3, 0xff000000u );
+        colours[ 3 ] = pack( (ar + 2 * br) / 3, (ag + 2 * bg) / 3,
+                (ab + 2 * bb) / 3, 0xff000000u );
+    }
+}
+
+// Write the 16 pixels of a block, rows are stride bytes apart
+static inline void
+decodeBlock( const uint8_t *block, uint8_t *out, uint32_t stride )
+{
+    uint32_t colours[ 4 ];
+    palette( block, colours );
+
+#if defined( __AVX2__ )
+    // two rows per step, the 2 bit indices are shifted into place per lane
+    // and used to permute the palette directly.
+    uint32_t bits;
+    memcpy( &bits, block + 4, 4 );
+    const __m256i lut = _mm256_setr_epi32(
+            colours[ 0 ], colours[ 1 ], colours[ 2 ], colours[ 3 ],
+            colours[ 0 ], colours[ 1 ], colours[ 2 ], colours[ 3 ] );
+    const __m256i shift = _mm256_setr_epi32( 0, 2, 4, 6, 8, 10, 12, 14 );
+    const __m256i three = _mm256_set1_epi32( 3 );
+    for( int row = 0; row < 4; row += 2 ){
+        __m256i index = _mm256_and_si256( three, _mm256_srlv_epi32(
+                _mm256_set1_epi32( bits >> (row * 8) ), shift ) );
+        __m256i pixels = _mm256_permutevar8x32_epi32( lut, index );
+        _mm_storeu_si128( (__m128i *)(out + stride * row),
+                _mm256_castsi256_si128( pixels ) );
+        _mm_storeu_si128( (__m128i *)(out + stride * (row + 1)),
+                _mm256_extracti128_si256( pixels, 1 ) );
+    }
+#elif defined( __SSE2__ )
+    // one row per step, each pixel selects between the palette entries
+    // using masks built from its two index bits.
+    const __m128i c0 = _mm_set1_epi32( colours[ 0 ] );
+    const __m128i c1 = _mm_set1_epi32( colours[ 1 ] );
+    const __m128i c2 = _mm_set1_epi32( colours[ 2 ] );
+    const __m128i c3 = _mm_set1_epi32( colours[ 3 ] );
+    const __m128i lowBit  = _mm_setr_epi32( 0x01, 0x04, 0x10, 0x40 );
+    const __m128i highBit = _mm_setr_epi32( 0x02, 0x08, 0x20, 0x80 );
+    for( int row = 0; row < 4; ++row ){
+        __m128i packed = _mm_set1_epi32( block[ 4 + row ] );
+        __m128i low  = _mm_cmpeq_epi32( _mm_and_si128( packed, lowBit ), lowBit );
+        __m128i high = _mm_cmpeq_epi32( _mm_and_si128( packed, highBit ), highBit );
+        __m128i c01 = _mm_or_si128( _mm_andnot_si128( low, c0 ), _mm_and_si128( low, c1 ) );
+        __m128i c23 = _mm_or_si128( _mm_andnot_si128( low, c2 ), _mm_and_si128( low, c3 ) );
+        __m128i pixels = _mm_or_si128( _mm_andnot_si128( high, c01 ), _mm_and_si128( high, c23 ) );
+        _mm_storeu_si128( (__m128i *)(out + stride * row), pixels );
+    }
+#else
+    for( int row = 0; row < 4; ++row ){
+        uint8_t packed = block[ 4 + row ];
+        uint32_t pixels[ 4 ] = {
+            colours[ packed & 0x3 ],
+            colours[ (packed >> 2) & 0x3 ],
+            colours[ (packed >> 4) & 0x3 ],
+            colours[ (packed >> 6) & 0x3 ] };
+        memcpy( out + stride * row, pixels, sizeof( pixels ) );
+    }
+#endif
+}
+
+void
+decodeDXT1( const uint8_t *blocks, uint32_t width, uint32_t height,
+        uint8_t *rgba )
+{
+    // partial blocks are rare enough to leave to squish
+    if( (width % 4) || (height % 4) ){
+        squish::DecompressImage( (squish::u8 *)rgba, width, height, blocks,
+                squish::kDxt1 );
+        return;
+    }
+
+    uint32_t stride = width * 4;
+    for( uint32_t y = 0; y < height; y += 4 ){
+        uint8_t *row = rgba + stride * y;
+        for( uint32_t x = 0; x < width; x += 4 ){
+            decodeBlock( blocks, row + x * 4, stride );
+            blocks += 8;
+        }
+    }
+}
+
+// Endpoint pairs for each 8 bit value, for 5 and 6 bit channels, with
+// the colour at index 2 interpolated at 1/3 in four colour mode or at 1/2
+// in three colour mode.
+struct SolidTable {
+    struct Entry {
+        uint8_t a, b, error;
+    };
+    Entry thirds5[ 256 ], thirds6[ 256 ];
+    Entry halves5[ 256 ], halves6[ 256 ];
+
+    SolidTable(){
+        build( thirds5, 5, 3 );
+        build( thirds6, 6, 3 );
+        build( halves5, 5, 2 );
+        build( halves6, 6, 2 );
+    }
+
+    // search every pair using the decoder's arithmetic
+    static void build( Entry *table, int bits, int divisor ){
+        int size = 1 << bits;
+        for( int value = 0; value < 256; ++value ){
+            Entry &best = table[ value ];
+            best.error = 255;
+            for( int a = 0; a < size; ++a ){
+                int ea = (a << (8 - bits)) | (a >> (2 * bits - 8));
+                for( int b = 0; b < size; ++b ){
+                    int eb = (b << (8 - bits)) | (b >> (2 * bits - 8));
+                    int colour = divisor == 3
+                        ? (2 * ea + eb) / 3 : (ea + eb) / 2;
+                    int error = abs( colour - value );
+                    if( error < best.error ){
+                        best.error = error;
+                        best.a = a;
+                        best.b = b;
+                    }
+                }
+            }
+        }
+    }
+};
+
+void
+solidDXT1( const uint8_t *rgba, uint8_t *block )
+{
+    static const SolidTable table;
+
+    if( rgba[ 3 ] < 128 ){
+        // three colour mode, every pixel takes the transparent index
+        static const uint8_t transparent[ 8 ] =
+            { 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff };
+        memcpy( block, transparent, 8 );
+        return;
+    }
+
+    // pick whichever mode lands closer over all three channels
+    const SolidTable::Entry *t[ 3 ] = {
+        &table.thirds5[ rgba[ 0 ] ],
+        &table.thirds6[ rgba[ 1 ] ],
+        &table.thirds5[ rgba[ 2 ] ] };
+    const SolidTable::Entry *h[ 3 ] = {
+        &table.halves5[ rgba[ 0 ] ],
+        &table.halves6[ rgba[ 1 ] ],
+        &table.halves5[ rgba[ 2 ] ] };
+    bool halves = h[ 0 ]->error + h[ 1 ]->error + h[ 2 ]->error
+                < t[ 0 ]->error + t[ 1 ]->error + t[ 2 ]->error;
+    const SolidTable::Entry **e = halves ? h : t;
+
+    uint32_t a = (e[ 0 ]->a << 11) | (e[ 1 ]->a << 5) | e[ 2 ]->a;
+    uint32_t b = (e[ 0 ]->b << 11) | (e[ 1 ]->b << 5) | e[ 2 ]->b;
+
+    // four colour mode needs a > b, three colour mode a <= b. Swapping the
+    // endpoints of the thirds moves the colour to index 3. Equal endpoints
+    // decode to the same colour in either mode.
+    uint8_t indices = 0xaa;
+    if( halves ? a > b : a < b ){
+        std::swap( a, b );
+        if(! halves ) indices = 0xff;
+    }
+
+    block[ 0 ] = a & 0xff;
+    block[ 1 ] = a >> 8;
+    block[ 2 ] = b & 0xff;
+    block[ 3 ] = b >> 8;
+    memset( block + 4, indices, 4 );
+}
+
+bool
+isSolidRGBA8( const uint8_t *rgba, uint32_t pixels )
+{
+    uint32_t first;
+    memcpy( &first, rgba, 4 );
+    for( uint32_t i = 1; i < pixels; ++i ){
+        uint32_t pixel;
+        memcpy( &pixel, rgba + i * 4, 4 );
+        if( pixel != first ) return false;
+    }
+    return true;
+}
+
+bool
+transparentDXT1( const uint8_t *blocks, uint32_t nBlocks )
+{
+    for( uint32_t i = 0; i < nBlocks; ++i, blocks += 8 ){
+        uint32_t a = blocks[ 0 ] | (blocks[ 1 ] << 8);
+        uint32_t b = blocks[ 2 ] | (blocks[ 3 ] << 8);
+        if( a > b ) continue;
+        // an index of 3 has both bits set
+        for( int row = 0; row < 4; ++row ){
+            uint8_t packed = blocks[ 4 + row ];
+            if( packed & (packed >> 1) & 0x55 ) return true;
+        }
+    }
+    return false;
+}
+
+DXT1Class
+classifyRGBA8( const uint8_t *rgba, uint32_t width, uint32_t height )
+{
+    // thresholds on the mean per channel variance
+    const double flat = 8.0;
+    const double smooth = 128.0;
+
+    uint32_t n = width * height;
+    uint64_t sum[ 3 ] = { 0, 0, 0 };
+    uint64_t sumSq[ 3 ] = { 0, 0, 0 };
+    for( uint32_t i = 0; i < n; ++i ){
+        for( int c = 0; c < 3; ++c ){
+            uint32_t v = rgba[ i * 4 + c ];
+            sum[ c ] += v;
+            sumSq[ c ] += v * v;
+        }
+    }
+
+    double variance = 0;
+    for( int c = 0; c < 3; ++c ){
+        double mean = (double)sum[ c ] / n;
+        variance += (double)sumSq[ c ] / n - mean * mean;
+    }
+    variance /= 3;
+
+    if( variance < flat ) return DXT1_FLAT;
+    if( variance < smooth ) return DXT1_SMOOTH;
+    return DXT1_DETAILED;
+}
+
+int
+squishFlags( DXT1Class c )
+{
+    if( c == DXT1_FLAT ) return squish::kDxt1 | squish::kColourRangeFit;
+    if( c == DXT1_SMOOTH ) return squish::kDxt1 | squish::kColourClusterFit;
+    return squish::kDxt1 | squish::kColourIterativeClusterFit;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+/// Decode dxt1 compressed data to RGBA8
+/*  Produces the same pixels as squish::DecompressImage with kDxt1, but
+ *  decodes whole rows of a block at a time using SSE2, or AVX2 when the
+ *  build targets it, and writes straight into the destination.
+ *  blocks: 8 bytes per 4x4 block, in rows of blocks.
+ *  rgba: destination of width * height * 4 bytes.
+ */
+void decodeDXT1( const uint8_t *blocks, uint32_t width, uint32_t height,
+        uint8_t *rgba );
+
+/// Colour detail classes used to choose a dxt1 encoder
+enum DXT1Class {
+    DXT1_SOLID,    //!< a single colour, encoded from a table
+    DXT1_FLAT,     //!< low variance, range fit is indistinguishable
+    DXT1_SMOOTH,   //!< gradients, cluster fit
+    DXT1_DETAILED, //!< high variance, iterative cluster fit
+    DXT1_NCLASSES
+};
+
+/// Encode a block of a single RGBA8 colour
+/*  The endpoints come from precomputed tables of the 5 and 6 bit pairs
+ *  whose interpolated colour is nearest each 8 bit value, so no fitting is
+ *  done and the result is never worse than squish's single colour fit.
+ *  The same block repeated makes up every mip of a solid tile.
+ *  Colours with alpha below 128 give a transparent black block.
+ */
+void solidDXT1( const uint8_t *rgba, uint8_t *block );
+
+/// Return true if every RGBA8 pixel has the same value
+bool isSolidRGBA8( const uint8_t *rgba, uint32_t pixels );
+
+/// Return true if any block selects the transparent colour
+/*  Only three colour blocks, where the first endpoint is not greater than
+ *  the second, have a transparent entry at index 3.
+ */
+bool transparentDXT1( const uint8_t *blocks, uint32_t nBlocks );
+
+/// Classify RGBA8 pixels by their colour variance
+DXT1Class classifyRGBA8( const uint8_t *rgba, uint32_t width, uint32_t height );
+
+/// squish compression flags used for a class
+int squishFlags( DXT1Class c );
@@ -0,0 +1,109 @@
+#include <cstring>
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
+#include "mipmap.h"
+
+void
+halveRGBA8( const uint8_t *src, uint32_t width, uint32_t height,
+        uint8_t *dst )
+{
+    const uint32_t stride = width * 4;
+    const uint32_t outWidth = width / 2;
+
+    for( uint32_t y = 0; y < height / 2; ++y ){
+        const uint8_t *row0 = src + stride * (y * 2);
+        const uint8_t *row1 = row0 + stride;
+        uint8_t *out = dst + outWidth * 4 * y;
+        uint32_t x = 0;
+
+#if defined( __SSE2__ )
+        // four output pixels from eight input pixels of each row
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i two = _mm_set1_epi16( 2 );
+        for( ; x + 4 <= outWidth; x += 4 ){
+            __m128i a0 = _mm_loadu_si128( (const __m128i *)(row0 + x * 8) );
+            __m128i b0 = _mm_loadu_si128( (const __m128i *)(row0 + x * 8 + 16) );
+            __m128i a1 = _mm_loadu_si128( (const __m128i *)(row1 + x * 8) );
+            __m128i b1 = _mm_loadu_si128( (const __m128i *)(row1 + x * 8 + 16) );
+
+            // vertical sums, two pixels per register
+            __m128i aLo = _mm_add_epi16( _mm_unpacklo_epi8( a0, zero ), _mm_unpacklo_epi8( a1, zero ) );
+            __m128i aHi = _mm_add_epi16( _mm_unpackhi_epi8( a0, zero ), _mm_unpackhi_epi8( a1, zero ) );
+            __m128i bLo = _mm_add_epi16( _mm_unpacklo_epi8( b0, zero ), _mm_unpacklo_epi8( b1, zero ) );
+            __m128i bHi = _mm_add_epi16( _mm_unpackhi_epi8( b0, zero ), _mm_unpackhi_epi8( b1, zero ) );
+
+            // horizontal sums of neighbouring pixels
+            __m128i a = _mm_add_epi16( _mm_unpacklo_epi64( aLo, aHi ), _mm_unpackhi_epi64( aLo, aHi ) );
+            __m128i b = _mm_add_epi16( _mm_unpacklo_epi64( bLo, bHi ), _mm_unpackhi_epi64( bLo, bHi ) );
+            a = _mm_srli_epi16( _mm_add_epi16( a, two ), 2 );
+            b = _mm_srli_epi16( _mm_add_epi16( b, two ), 2 );
+
+            _mm_storeu_si128( (__m128i *)(out + x * 4), _mm_packus_epi16( a, b ) );
+        }
+#endif
+        for( ; x < outWidth; ++x ){
+            for( int c = 0; c < 4; ++c ){
+                out[ x * 4 + c ] = (row0[ x * 8 + c ] + row0[ x * 8 + 4 + c ]
+                    + row1[ x * 8 + c ] + row1[ x * 8 + 4 + c ] + 2) >> 2;
+            }
+        }
+    }
+}
+
+size_t
+mipChainBytes( uint32_t width, uint32_t height, uint32_t levels,
+        uint32_t pixelBytes )
+{
+    size_t bytes = 0;
+    for( uint32_t i = 0; i < levels; ++i ){
+        bytes += (size_t)width * height * pixelBytes;
+        width /= 2;
+        height /= 2;
+    }
+    return bytes;
+}
+
+void
+buildMipChainRGBA8( uint8_t *chain, uint32_t width, uint32_t height,
+        uint32_t levels )
+{
+    for( uint32_t i = 1; i < levels; ++i ){
+        uint8_t *next = chain + (size_t)width * height * 4;
+        halveRGBA8( chain, width, height, next );
+        chain = next;
+        width /= 2;
+        height /= 2;
+    }
+}
+
+void
+halveUINT16( const uint16_t *src, uint32_t width, uint32_t height,
+        uint16_t *dst )
+{
+    const uint32_t outWidth = width / 2;
+    for( uint32_t y = 0; y < height / 2; ++y ){
+        const uint16_t *row0 = src + width * (y * 2);
+        const uint16_t *row1 = row0 + width;
+        uint16_t *out = dst + outWidth * y;
+        for( uint32_t x = 0; x < outWidth; ++x ){
+            out[ x ] = ((uint32_t)row0[ x * 2 ] + row0[ x * 2 + 1 ]
+                + row1[ x * 2 ] + row1[ x * 2 + 1 ] + 2) >> 2;
+        }
+    }
+}
+
+void
+buildMipChainUINT16( uint16_t *chain, uint32_t width, uint32_t height,
+        uint32_t levels )
+{
+    for( uint32_t i = 1; i < levels; ++i ){
+        uint16_t *next = chain + (size_t)width * height;
+        halveUINT16( chain, width, height, next );
+        chain = next;
+        width /= 2;
+        height /= 2;
+    }
+}
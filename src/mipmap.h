@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// Halve an RGBA8 image using a 2x2 box filter
+/*  width and height must be even, dst receives (width/2) * (height/2)
+ *  pixels. Uses SSE2 where available.
+ */
+void halveRGBA8( const uint8_t *src, uint32_t width, uint32_t height,
+        uint8_t *dst );
+
+/// Number of bytes needed to hold a mip chain
+size_t mipChainBytes( uint32_t width, uint32_t height, uint32_t levels,
+        uint32_t pixelBytes );
+
+/// Generate an RGBA8 mip chain in place
+/*  chain starts with the full resolution image, and each of the following
+ *  levels - 1 mips is written directly after the one before it, which is
+ *  the layout of uncompressed smt tiles. chain must hold mipChainBytes().
+ */
+void buildMipChainRGBA8( uint8_t *chain, uint32_t width, uint32_t height,
+        uint32_t levels );
+
+/// Halve a single channel UINT16 image using a 2x2 box filter
+/*  width and height must be even, dst receives (width/2) * (height/2)
+ *  pixels.
+ */
+void halveUINT16( const uint16_t *src, uint32_t width, uint32_t height,
+        uint16_t *dst );
+
+/// Generate a single channel UINT16 mip chain in place
+/*  Same layout as buildMipChainRGBA8, chain must hold
+ *  mipChainBytes( width, height, levels, 2 ) bytes.
+ */
+void buildMipChainUINT16( uint16_t *chain, uint32_t width, uint32_t height,
+        uint32_t levels );
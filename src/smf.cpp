@@ -9,6 +9,8 @@
 #include "smf.h"
 #include "smt.h"
 #include "util.h"
+#include "dxt1.h"
+#include "mipmap.h"
 
 OIIO_NAMESPACE_USING
 using namespace std;
@@ -664,37 +666,31 @@ SMF::writeMini( ImageBuf * sourceBuf )
     channels( tempBuf, _miniSpec );
     scale( tempBuf, _miniSpec );
 
-    ImageSpec spec;
-    int blocks_size = 0;
-    squish::u8 *blocks = nullptr;
-    for( int i = 0; i < 9; ++i ){
-        DLOG( INFO ) << "mipmap loop: " << i;
-        spec = tempBuf->specmod();
-
-        blocks_size = squish::GetStorageRequirements(
-                spec.width, spec.height, squish::kDxt1 );
+    // build all nine levels of the mip chain up front from the 1024x1024
+    // image, then compress each one in turn.
+    std::vector< uint8_t > chain( mipChainBytes( 1024, 1024, 9, 4 ) );
+    const ImageSpec &miniSpec = tempBuf->spec();
+    tempBuf->get_pixels( miniSpec.x, miniSpec.x + 1024, miniSpec.y, miniSpec.y + 1024,
+            0, 1, TypeDesc::UINT8, chain.data() );
+    delete tempBuf;
+    buildMipChainRGBA8( chain.data(), 1024, 1024, 9 );
 
-        if( blocks == nullptr ){
-            DLOG( INFO ) << "allocating space: " << blocks_size;
-            blocks = new squish::u8[ blocks_size ];
-        }
+    std::vector< squish::u8 > blocks(
+            squish::GetStorageRequirements( 1024, 1024, squish::kDxt1 ) );
+    const squish::u8 *mip = chain.data();
+    for( int i = 0, size = 1024; i < 9; ++i, size >>= 1 ){
+        DLOG( INFO ) << "mipmap loop: " << i;
+        int blocks_size = squish::GetStorageRequirements(
+                size, size, squish::kDxt1 );
 
         DLOG( INFO ) << "compressing to dxt1";
-        squish::CompressImage( (squish::u8 *)tempBuf->localpixels(),
-                spec.width, spec.height, blocks, squish::kDxt1 );
+        squish::CompressImage( mip, size, size, blocks.data(), squish::kDxt1 );
 
         // Write data to smf
         DLOG( INFO ) << "writing dxt1 mip to file";
-        file.write( (char*)blocks, blocks_size );
-
-        spec.width = spec.width >> 1;
-        spec.height = spec.height >> 1;
-
-        DLOG( INFO ) << "Scaling to: " << spec.width << "x" << spec.height;
-        scale( tempBuf, spec );
+        file.write( (char*)blocks.data(), blocks_size );
+        mip += size * size * 4;
     }
-    delete blocks;
-    delete tempBuf;
 
     file.close();
 }
@@ -844,20 +840,18 @@ SMF::getMap( )
 
 ImageBuf *SMF::getMini(){
     ImageBuf * imageBuf = nullptr;
-    unsigned char data[ 1024 * 1024 * 4 ];
-    unsigned char temp[ MINIMAP_SIZE ];
+    std::vector< uint8_t > temp( MINIMAP_SIZE );
 
     ifstream file( _fileName );
     CHECK( file.good() ) << " Failed to open" << _fileName << "for reading";
 
     file.seekg( _header.miniPtr );
-    file.read( (char *)temp, MINIMAP_SIZE );
+    file.read( (char *)temp.data(), MINIMAP_SIZE );
     file.close();
 
-    squish::DecompressImage( (squish::u8 *)data, 1024, 1024, temp, squish::kDxt1);
-
+    // only the full resolution mip is decoded, straight into the image
     imageBuf = new ImageBuf( _miniSpec );
-    memcpy( imageBuf->localpixels(), data, 1024*1024*4 );
+    decodeDXT1( temp.data(), 1024, 1024, (uint8_t *)imageBuf->localpixels() );
 
     return imageBuf;
 }
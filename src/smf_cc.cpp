@@ -164,6 +164,7 @@ main( int argc, char **argv )
         CHECK( SMT::test( parse.nonOption( 0 ) ) )
                 << " additional arguments are not smt files";
         smt = SMT::open( parse.nonOption( 0 ) );
+        CHECK( smt ) << "unable to open " << parse.nonOption( 0 );
         tileSize = smt->tileSize;
         delete smt;
         smt = nullptr;
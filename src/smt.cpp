@@ -1,4 +1,12 @@
 #include <fstream>
+#include <algorithm>
+#include <numeric>
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <OpenImageIO/imageio.h>
 #include <OpenImageIO/imagebuf.h>
@@ -9,6 +17,8 @@
 #include "smf_tools.h"
 #include "smt.h"
 #include "util.h"
+#include "dxt1.h"
+#include "mipmap.h"
 
 using namespace std;
 OIIO_NAMESPACE_USING;
@@ -49,15 +59,31 @@ SMT::open( string fileName )
     if( test( fileName ) ){
         smt = new SMT;
         smt->_fileName = fileName;
-        smt->load();
+        if(! smt->load() ){
+            delete smt;
+            return nullptr;
+        }
         return smt;
     }
     return nullptr;
 }
 
+SMT::SMT( )
+{
+    for( auto &i : _classCount ) i = 0;
+}
+
+SMT::~SMT()
+{
+    endWrite();
+    unmapFile();
+}
+
 void
 SMT::reset( )
 {
+    endWrite();
+    unmapFile();
     LOG(INFO) << "Resetting " << fileName;
     // Clears content of SMT file and re-writes the header.
     fstream file( fileName, ios::binary | ios::out );
@@ -75,6 +101,10 @@ SMT::reset( )
     file.write( (char *)&header, sizeof(SMT::Header) );
     file.flush();
     file.close();
+
+    _index.clear();
+    _indexWritten = 0;
+    if( _indexed ) writeIndex();
 }
 
 void
@@ -83,6 +113,12 @@ SMT::setFileName( std::string name)
     _fileName = name;
 }
 
+void
+SMT::setEncoder( Encoder e )
+{
+    _encoder = e;
+}
+
 void
 SMT::setType( uint32_t t )
 {
@@ -122,7 +158,7 @@ SMT::calcTileBytes()
     else if( header.tileType == GL_RGBA8 ){
         _tileSpec = ImageSpec( tileSize, tileSize, 4, TypeDesc::UINT8 );
         for( int i=0; i < 4; ++i ){
-            _tileBytes += (mip * mip);
+            _tileBytes += (mip * mip) * 4;
             mip /= 2;
         }
     }
@@ -138,27 +174,31 @@ SMT::calcTileBytes()
     }
 }
 
-void
+bool
 SMT::load( )
 {
     ifstream inFile(fileName, ifstream::in);
     CHECK( inFile.good() ) << "Failed to load: " << fileName;
     inFile.read( (char *)&header, sizeof(SMT::Header) );
+    if( inFile.gcount() != sizeof(SMT::Header) ){
+        LOG( ERROR ) << fileName << " is too short to hold an smt header";
+        return false;
+    }
     calcTileBytes();
 
-    // do some simple checking of file size vs reported tile numbers
-    uint32_t actualBytes = 0;
-    uint32_t guessBytes = 0;
-    uint32_t guessTiles = 0;
-    uint32_t remainderBytes = 0;
+    // do some simple checking of file size vs reported tile numbers, in 64
+    // bits since uncompressed files easily pass 4GiB
+    uint64_t actualBytes = 0;
+    uint64_t guessBytes = 0;
+    uint64_t guessTiles = 0;
+    uint64_t remainderBytes = 0;
     inFile.seekg( 0, std::ios::end );
-    actualBytes = (uint32_t)inFile.tellg() - 32;
+    actualBytes = (uint64_t)inFile.tellg() - sizeof(SMT::Header);
     inFile.close();
-    guessBytes = header.nTiles * tileBytes; // file size - header
+    guessBytes = (uint64_t)header.nTiles * tileBytes; // file size - header
     guessTiles = actualBytes / tileBytes;
     remainderBytes = actualBytes % tileBytes;
 
-
     if( header.nTiles != guessTiles || actualBytes != guessBytes ) {
         LOG( WARN ) << "Possible Data Issue"
             << "\n\t(" << fileName << ").header.nTiles:\033[40G" << header.nTiles
@@ -168,6 +208,146 @@ SMT::load( )
             << "\n\tGuess Bytes:\033[40G" << guessBytes
             << "\n\tModulus remainder:\033[40G" << remainderBytes;
     }
+
+    loadIndex();
+    return true;
+}
+
+bool
+SMT::loadIndex()
+{
+    ifstream file( indexFileName(), ios::binary );
+    if(! file.good() ) return false;
+
+    IndexHeader indexHeader;
+    file.read( (char *)&indexHeader, sizeof(IndexHeader) );
+
+    struct stat st;
+    uint64_t smtBytes = stat( fileName.c_str(), &st ) ? 0 : st.st_size;
+    if( file.gcount() != sizeof(IndexHeader)
+     || strcmp( indexHeader.magic, IndexHeader().magic )
+     || indexHeader.version != IndexHeader().version
+     || indexHeader.nTiles != header.nTiles
+     || indexHeader.smtBytes != smtBytes ){
+        LOG( WARN ) << "Ignoring stale index " << indexFileName();
+        return false;
+    }
+
+    _index.resize( indexHeader.nTiles );
+    file.read( (char *)_index.data(), sizeof(TileStats) * _index.size() );
+    if( (size_t)file.gcount() != sizeof(TileStats) * _index.size() ){
+        LOG( WARN ) << "Ignoring truncated index " << indexFileName();
+        _index.clear();
+        return false;
+    }
+
+    _indexed = true;
+    _indexWritten = _index.size();
+    return true;
+}
+
+void
+SMT::writeIndex()
+{
+    // a new index file is created whenever nothing has been written yet
+    ios::openmode mode = ios::binary | ios::out;
+    if( _indexWritten ) mode |= ios::in;
+    fstream file( indexFileName(), mode );
+    if(! file.good() ){
+        LOG( ERROR ) << "Unable to write to " << indexFileName();
+        return;
+    }
+
+    IndexHeader indexHeader;
+    indexHeader.nTiles = _index.size();
+    indexHeader.smtBytes = sizeof(SMT::Header) + (uint64_t)tileBytes * header.nTiles;
+    file.write( (char *)&indexHeader, sizeof(IndexHeader) );
+
+    file.seekp( sizeof(IndexHeader) + sizeof(TileStats) * (uint64_t)_indexWritten );
+    file.write( (char *)(_index.data() + _indexWritten),
+            sizeof(TileStats) * (_index.size() - _indexWritten) );
+    _indexWritten = _index.size();
+}
+
+void
+SMT::setIndexed( bool indexed )
+{
+    if( _indexed == indexed ) return;
+    _indexed = indexed;
+    if(! _indexed ){
+        _index.clear();
+        _indexWritten = 0;
+        return;
+    }
+    buildIndex();
+}
+
+void
+SMT::buildIndex( uint32_t nThreads )
+{
+    CHECK( _writeFd < 0 ) << "Cannot index " << fileName << " during a write";
+    _indexed = true;
+    _index.assign( header.nTiles, TileStats() );
+    _indexWritten = 0;
+
+    // tiles are only safe to read concurrently from the mapping
+    if( nThreads == 0 ) nThreads = std::thread::hardware_concurrency();
+    if( nThreads == 0 || ! (header.nTiles && mapFile( ADVICE_SEQUENTIAL )) ){
+        nThreads = 1;
+    }
+
+    std::atomic< uint32_t > next( 0 );
+    auto worker = [&](){
+        for( uint32_t i = next++; i < header.nTiles; i = next++ ){
+            _index[ i ] = tileStats( getTileRaw( i ) );
+        }
+    };
+
+    std::vector< std::thread > threads;
+    for( uint32_t i = 1; i < nThreads; ++i ) threads.emplace_back( worker );
+    worker();
+    for( auto &thread : threads ) thread.join();
+
+    writeIndex();
+}
+
+SMT::TileStats
+SMT::tileStats( const uint8_t *raw ) const
+{
+    TileStats stats;
+    stats.hash = hash64( raw, tileBytes );
+
+    static thread_local std::vector< uint8_t > pixels;
+    pixels.resize( tileSpec.image_bytes() );
+    decodeTile( raw, pixels.data() );
+
+    // sums over every channel, the variance only covers colour channels
+    int nChannels = tileSpec.nchannels;
+    int nColour = std::min( nChannels, 3 );
+    bool wide = tileSpec.format == TypeDesc::UINT16;
+    double scale = wide ? 65535.0 : 255.0;
+    uint32_t nPixels = tileSize * tileSize;
+
+    double sum[ 4 ] = { 0, 0, 0, 0 };
+    double sumSq[ 4 ] = { 0, 0, 0, 0 };
+    for( uint32_t i = 0; i < nPixels; ++i ){
+        for( int c = 0; c < nChannels; ++c ){
+            double v = wide
+                ? ((const uint16_t *)pixels.data())[ i * nChannels + c ]
+                : pixels[ i * nChannels + c ];
+            sum[ c ] += v;
+            sumSq[ c ] += v * v;
+        }
+    }
+
+    double variance = 0;
+    for( int c = 0; c < nChannels; ++c ){
+        double mean = sum[ c ] / nPixels;
+        stats.mean[ c ] = mean / scale;
+        if( c < nColour ) variance += (sumSq[ c ] / nPixels - mean * mean);
+    }
+    stats.variance = variance / nColour / (scale * scale);
+    return stats;
 }
 
 std::string
@@ -185,195 +365,579 @@ SMT::info( )
     else {
         ss << "UNKNOWN";
     }
+    if( _indexed ) ss << endl << "\tIndex: " << indexFileName();
     return ss.str();
 }
 
+bool
+SMT::encode( const OpenImageIO::ImageBuf &sourceBuf, uint8_t *data,
+        DXT1Class *dxt1Class ) const
+{
+    //sourceBuf.write( "SMT_append_sourcebuf.tif", "tif" );
+
+    DXT1Class encoded = DXT1_NCLASSES;
+    bool result = false;
+    if( tileType == 1                 ) result = encodeDXT1(   sourceBuf, data, encoded );
+    if( tileType == GL_RGBA8          ) result = encodeRGBA8(  sourceBuf, data );
+    if( tileType == GL_UNSIGNED_SHORT ) result = encodeUSHORT( sourceBuf, data );
+    if( dxt1Class ) *dxt1Class = encoded;
+    return result;
+}
+
+bool
+SMT::encodeSolid( const uint8_t *rgba, uint8_t *data ) const
+{
+    // every mip of a solid tile is the same colour
+    if( tileType == 1 ){
+        solidDXT1( rgba, data );
+        for( uint32_t i = 8; i < tileBytes; i += 8 ) memcpy( data + i, data, 8 );
+        return true;
+    }
+    if( tileType == GL_RGBA8 ){
+        for( uint32_t i = 0; i < tileBytes; i += 4 ) memcpy( data + i, rgba, 4 );
+        return true;
+    }
+    return false;
+}
+
+uint32_t
+SMT::verifyTile( const uint8_t *raw ) const
+{
+    // the mean absolute difference per channel, in 8 bit units, allowed
+    // between a mip and the filtered mip above it, generous enough to
+    // cover separate dxt1 compression of each level. Other encoders filter
+    // differently, so this is only a warning.
+    const uint32_t tolerance = 32;
+
+    bool empty = true;
+    for( uint32_t i = 0; i < tileBytes && empty; ++i ) empty = ! raw[ i ];
+    if( empty ) return WARN_EMPTY;
+
+    uint32_t warnings = 0;
+    bool wide = tileType == GL_UNSIGNED_SHORT;
+    uint32_t pixelBytes = tileSpec.pixel_bytes();
+    uint32_t nChannels = tileSpec.nchannels;
+
+    // decode every mip into one chain
+    static thread_local std::vector< uint8_t > chain;
+    chain.resize( mipChainBytes( tileSize, tileSize, 4, pixelBytes ) );
+    if( tileType == 1 ){
+        const uint8_t *blocks = raw;
+        uint8_t *mip = chain.data();
+        for( uint32_t size = tileSize; size >= tileSize / 8; size /= 2 ){
+            uint32_t nBlocks = (size / 4) * (size / 4);
+            if( transparentDXT1( blocks, nBlocks ) ) warnings |= WARN_TRANSPARENT;
+            decodeDXT1( blocks, size, size, mip );
+            blocks += nBlocks * 8;
+            mip += size * size * 4;
+        }
+    }
+    else {
+        memcpy( chain.data(), raw, chain.size() );
+    }
+
+    static thread_local std::vector< uint8_t > halved;
+    const uint8_t *mip = chain.data();
+    for( uint32_t size = tileSize; size > tileSize / 8; size /= 2 ){
+        const uint8_t *next = mip + size * size * pixelBytes;
+        uint32_t count = (size / 2) * (size / 2) * nChannels;
+        halved.resize( count * (wide ? 2 : 1) );
+
+        uint64_t difference = 0;
+        if( wide ){
+            const uint16_t *expected = (const uint16_t *)halved.data();
+            halveUINT16( (const uint16_t *)mip, size, size, (uint16_t *)halved.data() );
+            for( uint32_t i = 0; i < count; ++i ){
+                difference += abs( ((const uint16_t *)next)[ i ] - expected[ i ] ) >> 8;
+            }
+        }
+        else {
+            halveRGBA8( mip, size, size, halved.data() );
+            for( uint32_t i = 0; i < count; ++i ){
+                difference += abs( next[ i ] - halved[ i ] );
+            }
+        }
+        if( difference > (uint64_t)tolerance * count ) warnings |= WARN_MIPS;
+        mip = next;
+    }
+    return warnings;
+}
+
 void
 SMT::append( const OpenImageIO::ImageBuf &sourceBuf )
 {
-    //sourceBuf.write( "SMT_append_sourcebuf.tif", "tif" );
+    std::vector< uint8_t > tile( tileBytes );
+    DXT1Class dxt1Class;
+    if( encode( sourceBuf, tile.data(), &dxt1Class ) ) appendRaw( tile.data(), dxt1Class );
+}
 
-    if( tileType == 1                 ) appendDXT1(   sourceBuf );
-    if( tileType == GL_RGBA8           ) appendRGBA8( sourceBuf );
-    if( tileType == GL_UNSIGNED_SHORT ) appendUSHORT( sourceBuf );
+void
+SMT::appendRaw( const uint8_t *data, DXT1Class dxt1Class,
+        const TileStats *stats )
+{
+    writeTile( (const char *)data, stats );
+    // counted as written, so that tiles encoded and then discarded are not
+    if( dxt1Class < DXT1_NCLASSES ) ++_classCount[ dxt1Class ];
 }
 
 void
-SMT::appendDXT1( const OpenImageIO::ImageBuf &sourceBuf )
+SMT::tilePixels( const OpenImageIO::ImageBuf &sourceBuf, uint8_t *pixels ) const
 {
-    // make a copy of the input buffer for processing
+    const ImageSpec &spec = sourceBuf.spec();
+    if( spec.width == tileSpec.width && spec.height == tileSpec.height
+     && spec.nchannels == tileSpec.nchannels ){
+        sourceBuf.get_pixels( spec.x, spec.x + spec.width,
+                spec.y, spec.y + spec.height, 0, 1, tileSpec.format, pixels );
+        return;
+    }
+
+    // only buffers of the wrong shape pay for a copy
     std::unique_ptr< OpenImageIO::ImageBuf >
             tempBuf( new ImageBuf( sourceBuf ) );
+    tempBuf = fix_scale( std::move( tempBuf ), tileSpec );
+    tempBuf = fix_channels( std::move( tempBuf ), tileSpec );
+    const ImageSpec &tempSpec = tempBuf->spec();
+    tempBuf->get_pixels( tempSpec.x, tempSpec.x + tempSpec.width,
+            tempSpec.y, tempSpec.y + tempSpec.height, 0, 1,
+            tileSpec.format, pixels );
+}
 
-    // imagespec will let us work through the image contents
-    ImageSpec spec;
-    // block_size tells us how much memory to allocate per DXT compress cycle
-    int blocks_size = 0;
-    // blocks is the resulting memory area for DXT1 compresed files
-    squish::u8 *blocks = nullptr;
+bool
+SMT::encodeDXT1( const OpenImageIO::ImageBuf &sourceBuf, uint8_t *data,
+        DXT1Class &dxt1Class ) const
+{
+    // the uncompressed mip chain, kept per thread so that encoding a tile
+    // does not allocate.
+    static thread_local std::vector< uint8_t > chain;
+    chain.resize( mipChainBytes( tileSize, tileSize, 4, 4 ) );
+    tilePixels( sourceBuf, chain.data() );
+    if( isSolidRGBA8( chain.data(), tileSize * tileSize ) ){
+        dxt1Class = DXT1_SOLID;
+        return encodeSolid( chain.data(), data );
+    }
+    buildMipChainRGBA8( chain.data(), tileSize, tileSize, 4 );
 
-    // open our filestream and get ready to start writing dxt images to it
-    fstream file(fileName, ios::binary | ios::in | ios::out);
-    file.seekp( sizeof(SMT::Header) + tileBytes * header.nTiles );
+    // choose the encoder from the full resolution mip
+    dxt1Class = DXT1_DETAILED;
+    if( _encoder == ENCODER_FAST ) dxt1Class = DXT1_FLAT;
+    if( _encoder == ENCODER_ADAPTIVE ){
+        dxt1Class = classifyRGBA8( chain.data(), tileSize, tileSize );
+    }
+    int flags = squishFlags( dxt1Class );
 
-    // loop through the mipmaps
-    for( int i = 0; i < 4; ++i ){
+    // each mip is compressed into the tile data in turn
+    const squish::u8 *mip = chain.data();
+    squish::u8 *blocks = (squish::u8 *)data;
+    for( uint32_t i = 0, size = tileSize; i < 4; ++i, size >>= 1 ){
 #ifdef DEBUG_IMG
         std::stringstream ss;
-        ss << "SMT.appendDXT1.mip" << i << ".tif";
+        ss << "SMT.encodeDXT1.mip" << i << ".tif";
         DLOG( INFO ) << "writing mip to file: " << ss.str();
-        tempBuf->write( ss.str(), "tif" );
+        ImageBuf( ss.str(), ImageSpec( size, size, 4, TypeDesc::UINT8 ),
+                (void *)mip ).write( ss.str(), "tif" );
 #endif
-        spec = tempBuf->specmod();
-        DLOG( INFO ) << "mip: " << i << ", size: " << spec.width << "x" << spec.height << "x" << spec.nchannels;
+        DLOG( INFO ) << "mip: " << i << ", size: " << size << "x" << size;
+
+        squish::CompressImage( mip, size, size, blocks, flags );
+        DLOG( INFO ) << "\n" << image_to_hex( mip, size, size );
+        DLOG( INFO ) << "\n" << image_to_hex( blocks, size, size, 1 );
+
+        mip += size * size * 4;
+        blocks += squish::GetStorageRequirements( size, size, squish::kDxt1 );
+    }
+    return true;
+}
+
+bool
+SMT::encodeRGBA8( const OpenImageIO::ImageBuf &sourceBuf, uint8_t *data ) const
+{
+    // the tile layout is the mip chain itself
+    tilePixels( sourceBuf, data );
+    buildMipChainRGBA8( data, tileSize, tileSize, 4 );
+    return true;
+}
 
-        blocks_size = squish::GetStorageRequirements(
-            spec.width, spec.height, squish::kDxt1 );
-        DLOG( INFO ) << "dxt1 requires " << blocks_size << " bytes";
+void
+SMT::writeTile( const char *data, const TileStats *stats )
+{
+    CHECK( header.nTiles < UINT32_MAX ) << fileName << " cannot hold any more tiles";
+    if( _indexed ){
+        _index.push_back( stats ? *stats : tileStats( (const uint8_t *)data ) );
+    }
 
-        // allocate memory the first time, will be re-used in subsequent runs.
-        if( blocks == nullptr ) blocks = new squish::u8[ blocks_size ];
+    // Outside of a writer session every tile is written straight to disk
+    // along with the updated tile count.
+    if( _writeFd < 0 ){
+        unmapFile();
+        fstream file(fileName, ios::binary | ios::in | ios::out);
+        file.seekp( sizeof(SMT::Header) + (uint64_t)tileBytes * header.nTiles );
+        file.write( data, tileBytes );
 
-        // TODO contemplate giving control of compression options to users
-        // kColourRangeFit = faster|poor quality
-        // kColourMetricPerceptual = default|default
-        // kColourIterativeClusterFit = slow|high quality
-        CHECK( tempBuf->localpixels() ) << "pixel data unavailable";
-        squish::CompressImage( (squish::u8 *)tempBuf->localpixels(),
-            spec.width, spec.height, blocks,
-            squish::kDxt1 | squish::kColourRangeFit );
-        DLOG( INFO ) << "\n" << image_to_hex( (const uint8_t *)tempBuf->localpixels(), spec.width, spec.height );
-        DLOG( INFO ) << "\n" << image_to_hex( (const uint8_t *)blocks, spec.width, spec.height, 1 );
+        ++header.nTiles;
 
-        // Write data to smf
-        DLOG( INFO ) << "writing " << blocks_size << " to " << fileName;
-        file.write( (char*)blocks, blocks_size );
+        file.seekp( 20 );
+        file.write( (char *)&(header.nTiles), 4 );
 
-        spec = ImageSpec(spec.width >> 1, spec.height >> 1, spec.nchannels, spec.format );
-        tempBuf = fix_scale( std::move( tempBuf ), spec );
+        file.flush();
+        file.close();
+        if( _indexed ) writeIndex();
+        return;
     }
 
-    if( blocks != nullptr ) delete blocks;
+    _writeBuffer.insert( _writeBuffer.end(), data, data + tileBytes );
     ++header.nTiles;
+    if( _writeBuffer.size() >= _writeBlockBytes ) flushWrite();
+}
 
-    file.seekp( 20 );
-    file.write( (char *)&(header.nTiles), 4 );
+void
+SMT::flushWrite()
+{
+    if( _writeFd < 0 || _writeBuffer.empty() ) return;
+
+    // the buffer holds the most recently appended tiles
+    uint32_t bufferedTiles = _writeBuffer.size() / tileBytes;
+    off_t offset = sizeof(SMT::Header)
+        + (off_t)tileBytes * (header.nTiles - bufferedTiles);
+
+    const char *data = _writeBuffer.data();
+    size_t remaining = _writeBuffer.size();
+    while( remaining ){
+        ssize_t written = pwrite( _writeFd, data, remaining, offset );
+        CHECK( written > 0 ) << "Failed writing tiles to " << fileName;
+        data += written;
+        offset += written;
+        remaining -= written;
+    }
+    _writeBuffer.clear();
+}
 
-    file.flush();
-    file.close();
+void
+SMT::beginWrite( uint32_t reserveTiles )
+{
+    if( _writeFd >= 0 ) return;
+    unmapFile();
+
+    _writeFd = ::open( fileName.c_str(), O_WRONLY );
+    CHECK( _writeFd >= 0 ) << "Unable to open " << fileName << " for writing";
+    _writeBuffer.reserve( _writeBlockBytes + tileBytes );
+
+    // preallocate room for the expected tiles, endWrite() trims the file
+    // back to the tiles actually written.
+    if( reserveTiles ){
+        off_t bytes = sizeof(SMT::Header)
+            + (off_t)tileBytes * ((off_t)header.nTiles + reserveTiles);
+        if( posix_fallocate( _writeFd, 0, bytes ) ){
+            LOG( WARN ) << "Unable to preallocate " << bytes << " bytes for " << fileName;
+        }
+    }
 }
 
 void
-SMT::appendRGBA8( const OpenImageIO::ImageBuf &sourceBuf )
+SMT::endWrite()
 {
-    std::unique_ptr< OpenImageIO::ImageBuf >
-            tempBuf( new OpenImageIO::ImageBuf( sourceBuf ) );
+    if( _writeFd < 0 ) return;
 
-    ImageSpec spec;
-    fstream file(fileName, ios::binary | ios::in | ios::out);
-    file.seekp( sizeof(SMT::Header) + tileBytes * header.nTiles );
-    for( int i = 0; i < 4; ++i ){
-        spec = tempBuf->specmod();
+    flushWrite();
 
-        // Write data to smf
-        file.write( (char*)tempBuf->localpixels(), spec.image_bytes() );
+    CHECK( pwrite( _writeFd, &header, sizeof(SMT::Header), 0 )
+        == sizeof(SMT::Header) ) << "Failed writing header to " << fileName;
 
-        spec.width = spec.width >> 1;
-        spec.height = spec.height >> 1;
-        tempBuf = fix_scale( std::move( tempBuf ), spec );
+    off_t bytes = sizeof(SMT::Header) + (off_t)tileBytes * header.nTiles;
+    if( ftruncate( _writeFd, bytes ) ){
+        LOG( WARN ) << "Unable to trim " << fileName << " to " << bytes << " bytes";
     }
 
-    ++header.nTiles;
+    ::close( _writeFd );
+    _writeFd = -1;
+    _writeBuffer.clear();
+    _writeBuffer.shrink_to_fit();
 
-    file.seekp( 20 );
-    file.write( (char *)&(header.nTiles), 4 );
+    if( _indexed ) writeIndex();
+}
 
-    file.flush();
-    file.close();
+bool
+SMT::encodeUSHORT( const OpenImageIO::ImageBuf &sourceBuf, uint8_t *data ) const
+{
+    // the tile layout is the mip chain itself
+    tilePixels( sourceBuf, data );
+    buildMipChainUINT16( (uint16_t *)data, tileSize, tileSize, 4 );
+    return true;
 }
 
-void
-SMT::appendUSHORT( const OpenImageIO::ImageBuf &sourceBuf )
+std::unique_ptr< OpenImageIO::ImageBuf >
+SMT::getTile( const uint32_t n, const uint32_t mip )
 {
-    return;
+    CHECK( mip < nMips ) << "mip level:" << mip << " is out of range 0-" << nMips;
+    if( tileType != 1 && tileType != GL_RGBA8 && tileType != GL_UNSIGNED_SHORT ){
+        return nullptr;
+    }
+
+    std::string name = fileName + "_" + to_string( n );
+    if( mip ) name += "_" + to_string( mip );
+    std::unique_ptr< OpenImageIO::ImageBuf >
+        outBuf( new ImageBuf( name, mipSpec( mip ) ) );
+    decodeTile( getTileRaw( n ), (uint8_t *)outBuf->localpixels(), mip );
+    return outBuf;
 }
 
 std::unique_ptr< OpenImageIO::ImageBuf >
 SMT::getTile( uint32_t n )
 {
     if( tileType == 1                 ) return getTileDXT1( n );
-//    if( tileType == GL_RGBA8          ) return getTileRGBA8( n );
-//    if( tileType == GL_UNSIGNED_SHORT ) return getTileUSHORT( n );
+    if( tileType == GL_RGBA8          ) return getTile( n, 0 );
+    if( tileType == GL_UNSIGNED_SHORT ) return getTile( n, 0 );
     std::unique_ptr< OpenImageIO::ImageBuf > temp;
     return temp;
 }
 
-std::unique_ptr< OpenImageIO::ImageBuf >
-SMT::getTileDXT1( const uint32_t n )
+bool
+SMT::mapFile( Advice advice )
 {
-    CHECK( n >= 0 && n < header.nTiles ) << "tile index:" << n
-        << " is out of range 0-" << header.nTiles;
+    std::lock_guard< std::mutex > lock( _mapMutex );
+    // asking for the mapping tries again after a failure
+    _mapFailed = false;
+    if(! mapLocked() ) return false;
+
+    int hint = MADV_NORMAL;
+    if( advice == ADVICE_SEQUENTIAL ) hint = MADV_SEQUENTIAL;
+    if( advice == ADVICE_RANDOM     ) hint = MADV_RANDOM;
+    madvise( (void *)_map, _mapBytes, hint );
+    return true;
+}
 
-    std::unique_ptr< char > raw_dxt1a( new char[ tileBytes ] );
+bool
+SMT::readMapped()
+{
+    std::lock_guard< std::mutex > lock( _mapMutex );
+    return mapLocked();
+}
 
-    ifstream file( fileName );
-    CHECK( file.good() ) << "Failed to open file for reading" ;
+bool
+SMT::mapLocked()
+{
+    if( _map ) return true;
+    if( _mapFailed || _writeFd >= 0 ) return false;
+
+    _mapFailed = true;
+    int fd = ::open( fileName.c_str(), O_RDONLY );
+    if( fd < 0 ) return false;
+
+    // files beyond the address space are read without the mapping
+    struct stat st;
+    if( fstat( fd, &st ) || st.st_size == 0
+     || (uint64_t)st.st_size > SIZE_MAX ){
+        ::close( fd );
+        return false;
+    }
 
-    file.seekg( sizeof(SMT::Header) + tileBytes * n );
-    file.read( (char *)raw_dxt1a.get(), tileBytes );
-    file.close();
+    void *map = mmap( nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    // the mapping holds its own reference to the file
+    ::close( fd );
+    if( map == MAP_FAILED ){
+        LOG( WARN ) << "Unable to map " << fileName;
+        return false;
+    }
+    _map = (const uint8_t *)map;
+    _mapBytes = st.st_size;
+    _mapFailed = false;
+    return true;
+}
 
-    std::unique_ptr< char >
-            rgba8888( new char[ header.tileSize * header.tileSize * 4 ] );
+void
+SMT::unmapFile()
+{
+    std::lock_guard< std::mutex > lock( _mapMutex );
+    _mapFailed = false;
+    if(! _map ) return;
+    munmap( (void *)_map, _mapBytes );
+    _map = nullptr;
+    _mapBytes = 0;
+}
 
-    squish::DecompressImage( (squish::u8 *)( rgba8888.get() ),
-            header.tileSize, header.tileSize, raw_dxt1a.get(), squish::kDxt1 );
+const uint8_t *
+SMT::getTileRaw( const uint32_t n )
+{
+    CHECK( n < header.nTiles ) << "tile index:" << n
+        << " is out of range 0-" << header.nTiles;
 
-    std::unique_ptr< OpenImageIO::ImageBuf >
-        tempBuf( new ImageBuf( fileName + "_" + to_string( n ),
-                tileSpec, rgba8888.get() ) );
+    // the write buffer holds the most recently appended tiles
+    uint32_t bufferedTiles = _writeBuffer.size() / tileBytes;
+    if( _writeFd >= 0 && n >= header.nTiles - bufferedTiles ){
+        return (const uint8_t *)_writeBuffer.data()
+            + (uint64_t)tileBytes * (n - (header.nTiles - bufferedTiles));
+    }
 
-    std::unique_ptr< OpenImageIO::ImageBuf >
-            outBuf( new OpenImageIO::ImageBuf );
-    outBuf->copy( *tempBuf );
+    uint64_t offset = sizeof(SMT::Header) + (uint64_t)tileBytes * n;
+    bool mapped = readMapped();
+    if( mapped && offset + tileBytes <= _mapBytes ) return _map + offset;
+
+    // fall back to reading the tile when the file cannot be mapped, each
+    // thread reading into its own buffer. Whatever is missing from the end
+    // of a truncated file reads as zero.
+    static thread_local std::vector< uint8_t > readBuffer;
+    readBuffer.assign( tileBytes, 0 );
+    uint64_t bytes = 0;
+    if( mapped ){
+        if( offset < _mapBytes ){
+            bytes = std::min< uint64_t >( tileBytes, _mapBytes - offset );
+            memcpy( readBuffer.data(), _map + offset, bytes );
+        }
+    }
+    else {
+        ifstream file( fileName, ios::binary );
+        file.seekg( offset );
+        file.read( (char *)readBuffer.data(), tileBytes );
+        bytes = file.gcount();
+    }
+    if( bytes < tileBytes ){
+        LOG( WARN ) << "tile index:" << n << " is truncated in " << fileName;
+    }
+    return readBuffer.data();
+}
 
-    return outBuf;
+std::vector< uint8_t >
+SMT::getTiles( const uint32_t first, const uint32_t count )
+{
+    std::vector< uint32_t > indices( count );
+    std::iota( indices.begin(), indices.end(), first );
+    return getTiles( indices );
 }
 
-ImageBuf *
-SMT::getTileRGBA8( uint32_t n )
+std::vector< uint8_t >
+SMT::getTiles( const std::vector< uint32_t > &indices )
 {
-    ImageBuf *tempBuf = nullptr;
-    if( n >= header.nTiles ){
-        tempBuf = new ImageBuf( tileSpec );
-        return tempBuf;
+    size_t pixelBytes = tileSpec.image_bytes();
+    std::vector< uint8_t > arena( pixelBytes * indices.size() );
+    std::vector< uint8_t * > dest( indices.size() );
+    for( size_t k = 0; k < indices.size(); ++k ){
+        dest[ k ] = arena.data() + pixelBytes * k;
     }
+    getTiles( indices, dest.data() );
+    return arena;
+}
 
-    char *pixelData = nullptr;
-    ImageBuf *outBuf = nullptr;
+void
+SMT::getTiles( const std::vector< uint32_t > &indices, uint8_t * const *dest,
+        const uint32_t mip )
+{
+    CHECK( mip < nMips ) << "mip level:" << mip << " is out of range 0-" << nMips;
+
+    // visit the requests in file order
+    std::vector< size_t > order( indices.size() );
+    std::iota( order.begin(), order.end(), 0 );
+    std::sort( order.begin(), order.end(),
+        [&]( size_t a, size_t b ){ return indices[ a ] < indices[ b ]; } );
+
+    // a writer session may hold some of the tiles in its buffer, which
+    // getTileRaw() knows how to find
+    if( _writeFd >= 0 ){
+        for( size_t k = 0; k < indices.size(); ++k ){
+            decodeTile( getTileRaw( indices[ k ] ), dest[ k ], mip );
+        }
+        return;
+    }
 
-    ifstream file( fileName );
-    if( file.good() ){
-        pixelData = new char[ tileSpec.image_bytes() ];
-        outBuf = new ImageBuf;
+    bool mapped = readMapped();
+    std::vector< uint8_t > runBuffer;
+    ifstream file;
+    // unmapped runs are read into memory, so are kept to a sensible size
+    const uint32_t maxRunTiles = std::max< uint32_t >( 1, (64 << 20) / tileBytes );
+
+    for( size_t i = 0; i < order.size(); ){
+        // coalesce neighbouring and repeated tiles into a single run
+        uint32_t first = indices[ order[ i ] ];
+        uint32_t last = first;
+        size_t j = i + 1;
+        while( j < order.size() && indices[ order[ j ] ] - last <= 1
+            && (mapped || last - first < maxRunTiles) ){
+            last = indices[ order[ j ] ];
+            ++j;
+        }
+        CHECK( last < header.nTiles ) << "tile index:" << last
+            << " is out of range 0-" << header.nTiles;
+
+        uint64_t offset = sizeof(SMT::Header) + (uint64_t)tileBytes * first;
+        uint64_t bytes = (uint64_t)tileBytes * (last - first + 1);
+        // as with getTileRaw(), missing bytes of a truncated file are zero
+        const uint8_t *run = nullptr;
+        uint64_t found = bytes;
+        if( mapped && offset + bytes <= _mapBytes ){
+            run = _map + offset;
+        }
+        else if( mapped ){
+            found = offset < _mapBytes ? _mapBytes - offset : 0;
+            runBuffer.assign( bytes, 0 );
+            if( found ) memcpy( runBuffer.data(), _map + offset, found );
+            run = runBuffer.data();
+        }
+        else {
+            if(! file.is_open() ) file.open( fileName, ios::binary );
+            runBuffer.assign( bytes, 0 );
+            file.clear();
+            file.seekg( offset );
+            file.read( (char *)runBuffer.data(), bytes );
+            found = file.gcount();
+            run = runBuffer.data();
+        }
+        if( found < bytes ){
+            LOG( WARN ) << "tile index:" << last << " is truncated in " << fileName;
+        }
 
-        file.seekg( sizeof(SMT::Header) + tileBytes * n );
-        file.read( pixelData, tileSpec.image_bytes() );
+        for( ; i < j; ++i ){
+            uint32_t n = indices[ order[ i ] ];
+            decodeTile( run + (uint64_t)tileBytes * (n - first),
+                    dest[ order[ i ] ], mip );
+        }
+    }
+}
 
-        tempBuf = new ImageBuf( fileName + "_" + to_string(n), tileSpec, pixelData);
+void
+SMT::decodeTile( const uint8_t *raw, uint8_t *pixels, const uint32_t mip ) const
+{
+    raw += mipOffset( mip );
+    if( tileType == 1 ){
+        uint32_t size = header.tileSize >> mip;
+        decodeDXT1( raw, size, size, pixels );
+    }
+    else {
+        // uncompressed mips are already in the pixel layout
+        memcpy( pixels, raw, mipBytes( mip ) );
+    }
+}
 
-        outBuf->copy(*tempBuf);
+uint32_t
+SMT::mipBytes( const uint32_t mip ) const
+{
+    uint32_t size = header.tileSize >> mip;
+    // dxt1 packs 4x4 pixels in 8 bytes
+    if( tileType == 1 ) return (size * size) / 2;
+    return size * size * tileSpec.pixel_bytes();
+}
 
-        delete tempBuf;
-        delete [] pixelData;
-    }
-    file.close();
+uint32_t
+SMT::mipOffset( const uint32_t mip ) const
+{
+    uint32_t offset = 0;
+    for( uint32_t i = 0; i < mip; ++i ) offset += mipBytes( i );
+    return offset;
+}
 
-    return outBuf;
+OpenImageIO::ImageSpec
+SMT::mipSpec( const uint32_t mip ) const
+{
+    return ImageSpec( tileSize >> mip, tileSize >> mip,
+            tileSpec.nchannels, tileSpec.format );
 }
 
-ImageBuf *
-SMT::getTileUSHORT( uint32_t n )
+std::unique_ptr< OpenImageIO::ImageBuf >
+SMT::getTileDXT1( const uint32_t n )
 {
-    return nullptr;
+    const uint8_t *raw_dxt1a = getTileRaw( n );
+
+    // decompress directly into the pixels of the output buffer
+    std::unique_ptr< OpenImageIO::ImageBuf >
+        outBuf( new ImageBuf( fileName + "_" + to_string( n ), tileSpec ) );
+    decodeTile( raw_dxt1a, (uint8_t *)outBuf->localpixels() );
+
+    return outBuf;
 }
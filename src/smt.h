@@ -1,15 +1,48 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <mutex>
+#include <vector>
 
 #include <OpenImageIO/imagebuf.h>
 
+#include "dxt1.h"
+
 // Borrowing from OpenGL for texture compression formats for implementation
 #define GL_UNSIGNED_SHORT                 0x1403
 #define GL_RGBA8				0x8058
 
 class SMT {
 public:
+    /*! Access pattern hints for the read mapping
+     */
+    enum Advice {
+        ADVICE_NORMAL,     //!< no particular pattern
+        ADVICE_SEQUENTIAL, //!< tiles are read in file order
+        ADVICE_RANDOM      //!< tiles are read in arbitrary order
+    };
+
+    /*! dxt1 encoder selection
+     */
+    enum Encoder {
+        ENCODER_FAST,     //!< range fit for every tile
+        ENCODER_ADAPTIVE, //!< chosen per tile by colour variance
+        ENCODER_BEST      //!< iterative cluster fit for every tile
+    };
+
+    /*! Findings of verifyTile(), combined as bits
+     *
+     * These describe the content of a tile, which may be intended or the
+     * work of another encoder, so are only ever reported. What is repaired
+     * is decided by the structure of the file alone.
+     */
+    enum TileWarning {
+        WARN_EMPTY       = 1, //!< every byte is zero, as never written, pure black dxt1 and flat zero height tiles are
+        WARN_TRANSPARENT = 2, //!< dxt1 blocks select the transparent colour
+        WARN_MIPS        = 4  //!< the lower mips differ from a box filter of the first
+    };
+
     /*! Header Structure as written on disk.
      */
     struct Header {
@@ -20,6 +53,24 @@ public:
         uint32_t tileType = 1;     //!< must be 1=dxt1 for now
     };
 
+    /*! Sidecar index header, as written to fileName + ".idx"
+     */
+    struct IndexHeader {
+        char magic[8] = "smt.idx"; //!< "smt.idx\0"
+        uint32_t version = 1;      //!< index format version
+        uint32_t nTiles = 0;       //!< number of entries that follow
+        uint64_t smtBytes = 0;     //!< size of the smt file indexed
+    };
+
+    /*! Sidecar index entry, one per tile.
+     */
+    struct TileStats {
+        uint64_t hash = 0;         //!< hash64() of the encoded tile bytes
+        float mean[4] = {};        //!< mean of each channel of the first mip, 0-1
+        float variance = 0;        //!< mean variance of the colour channels, 0-1
+        uint32_t reserved = 0;
+    };
+
 private:
     //! File Header
     Header header;
@@ -31,15 +82,59 @@ private:
     uint32_t _tileBytes = 680; 
     OpenImageIO::ImageSpec _tileSpec;
 
-    //! load data from fileName
-    void load();
-    
-    void appendDXT1(   const OpenImageIO::ImageBuf & );
-    void appendRGBA8(  const OpenImageIO::ImageBuf & );
-    void appendUSHORT( const OpenImageIO::ImageBuf & );
+    //! load data from fileName, false if it is too short to be an smt
+    bool load();
+
+    //! dxt1 encoder policy, and the number of tiles written per class
+    Encoder _encoder = ENCODER_FAST;
+    std::atomic< uint64_t > _classCount[ DXT1_NCLASSES ];
+
+    //! Sidecar index, see setIndexed()
+    bool _indexed = false;
+    std::vector< TileStats > _index;
+    uint32_t _indexWritten = 0;   //!< entries already on disk
+
+    //! read and validate the sidecar index, false if missing or stale
+    bool loadIndex();
+    //! write the index header and any entries not yet on disk
+    void writeIndex();
+
+    //! Writer session state, see beginWrite()
+    int _writeFd = -1;
+    std::vector< char > _writeBuffer;
+    static const size_t _writeBlockBytes = 4 * 1024 * 1024;
+
+    //! Read only mapping of the file, see mapFile()
+    const uint8_t *_map = nullptr;
+    size_t _mapBytes = 0;
+    //! set when mapping failed, so reads don't retry it, see unmapFile()
+    bool _mapFailed = false;
+    //! guards the mapping, which the first read of any thread may create
+    std::mutex _mapMutex;
+
+    //! map the file unless it is or failed to be, with _mapMutex held
+    bool mapLocked();
+    //! the mapping for a read, false when reads go to the file
+    bool readMapped();
+
+    //! append one tile worth of encoded bytes to the file, and its index
+    //! entry when indexed, computed here unless given
+    void writeTile( const char *data, const TileStats *stats );
+    //! write out any tiles held in the write buffer
+    void flushWrite();
+
+    //! copy the pixels of a buffer, fitted to tileSpec
+    void tilePixels( const OpenImageIO::ImageBuf &, uint8_t *pixels ) const;
+    bool encodeDXT1(   const OpenImageIO::ImageBuf &, uint8_t *, DXT1Class & ) const;
+    bool encodeRGBA8(  const OpenImageIO::ImageBuf &, uint8_t * ) const;
+    bool encodeUSHORT( const OpenImageIO::ImageBuf &, uint8_t * ) const;
+    //! bytes of one mip level of an encoded tile, and where it starts
+    uint32_t mipBytes( const uint32_t mip ) const;
+    uint32_t mipOffset( const uint32_t mip ) const;
+    //! decode a mip of an encoded tile into mipSpec() pixels
+    void decodeTile( const uint8_t *raw, uint8_t *pixels,
+            const uint32_t mip = 0 ) const;
 	std::unique_ptr< OpenImageIO::ImageBuf> getTileDXT1( const uint32_t );
-    OpenImageIO::ImageBuf *getTileRGBA8( uint32_t );
-    OpenImageIO::ImageBuf *getTileUSHORT( uint32_t );
 
 public:
 
@@ -50,9 +145,12 @@ public:
     const uint32_t &tileSize = header.tileSize;
     const uint32_t &tileBytes = _tileBytes;
     const OpenImageIO::ImageSpec &tileSpec = _tileSpec;
+    //! per tile hashes and stats, empty unless the file is indexed
+    const std::vector< TileStats > &index = _index;
     
 
-    SMT( ){ };
+    SMT( );
+    ~SMT();
 
     /*! File type test.
      *
@@ -68,6 +166,12 @@ public:
      * @param overwrite if true; clobbers existing file data.
      */
     static SMT *create( std::string fileName, bool overwrite = false );
+
+    /*! Open an existing SMT file
+     *
+     * @return nullptr if the file is not an smt, or is shorter than its
+     * header.
+     */
     static SMT *open  ( std::string fileName );
 
     void reset( );
@@ -77,6 +181,169 @@ public:
     void setType    ( uint32_t t ); // 1=DXT1
     void setFileName( std::string name );
 
+    /*! Set the dxt1 encoder policy.
+     *
+     * ENCODER_FAST, the default, takes the range fit for every tile.
+     * ENCODER_ADAPTIVE classifies each tile by its colour variance, flat
+     * tiles take the fast range fit and only detailed tiles pay for the
+     * iterative cluster fit, which costs far more on most terrain.
+     */
+    void setEncoder( Encoder e );
+
+    /*! Keep a sidecar index of the tiles.
+     *
+     * The index lives in fileName + ".idx" and holds a hash, mean colour
+     * and variance for every tile, so that tiles can be compared without
+     * decoding them. It is kept up to date as tiles are appended, and is
+     * read back by open() when it matches the smt. Enabling it on a file
+     * that already has tiles builds it with buildIndex().
+     */
+    void setIndexed( bool indexed );
+    bool isIndexed() const { return _indexed; }
+
+    /*! Compute the index entry of every tile and write the sidecar.
+     *
+     * @param nThreads number of threads, 0 uses one per core
+     */
+    void buildIndex( uint32_t nThreads = 0 );
+
+    /*! Compute the index entry of an encoded tile.
+     *
+     * Safe to call from multiple threads, so that writers can work out
+     * the entries of their tiles before appending them.
+     * @param raw tileBytes of data in the format of this file
+     */
+    TileStats tileStats( const uint8_t *raw ) const;
+
+    //! name of the sidecar index file
+    std::string indexFileName() const { return fileName + ".idx"; }
+
+    //! number of dxt1 tiles of class c written, see appendRaw()
+    uint64_t classCount( DXT1Class c ) const { return _classCount[ c ]; }
+
+    /*! Get the first mip of a tile.
+     *
+     * The tile is decoded, or for uncompressed tiles copied, into a new
+     * buffer owned by the caller.
+     */
 	std::unique_ptr< OpenImageIO::ImageBuf > getTile( const uint32_t );
+
+    /*! Get one of the stored mips of a tile.
+     *
+     * Every tile holds four mips, each half the size of the last. Only
+     * the bytes of the requested mip are read, and returned as getTile()
+     * would.
+     * @param n tile index
+     * @param mip level from 0, full size, to nMips - 1
+     */
+    std::unique_ptr< OpenImageIO::ImageBuf > getTile( const uint32_t n,
+            const uint32_t mip );
+
+    //! number of mip levels stored in each tile
+    static const uint32_t nMips = 4;
+
+    /*! Pixel layout of a decoded mip, tileSpec at mip 0. */
+    OpenImageIO::ImageSpec mipSpec( const uint32_t mip ) const;
+
     void append( const OpenImageIO::ImageBuf & );
+
+    /*! Encode a tile without writing it.
+     *
+     * Safe to call from multiple threads.
+     * @param data receives tileBytes of encoded data
+     * @param dxt1Class if given, receives the class dxt1 tiles were
+     * encoded as, or DXT1_NCLASSES for other tile types
+     * @return false if the tile type cannot be encoded
+     */
+    bool encode( const OpenImageIO::ImageBuf &, uint8_t *data,
+            DXT1Class *dxt1Class = nullptr ) const;
+
+    /*! Encode a tile of a single colour without any fitting.
+     *
+     * @param rgba the colour as four 8 bit channels
+     * @param data receives tileBytes of encoded data
+     * @return false if the tile type cannot be encoded this way
+     */
+    bool encodeSolid( const uint8_t *rgba, uint8_t *data ) const;
+
+    /*! Check an encoded tile.
+     *
+     * Every mip is decoded, and each is compared with a box filtered copy
+     * of the mip above it. Safe to call from multiple threads.
+     * @param raw tileBytes of data in the format of this file
+     * @return a combination of TileWarning bits, 0 when nothing was found
+     */
+    uint32_t verifyTile( const uint8_t *raw ) const;
+
+    /*! Append an already encoded tile.
+     *
+     * @param data tileBytes of data in the format of this file, as
+     * returned by getTileRaw()
+     * @param dxt1Class the class the tile was encoded as, counted in
+     * classCount(), DXT1_NCLASSES when unknown
+     * @param stats the index entry of the tile as returned by tileStats(),
+     * computed here when the file is indexed and none is given
+     */
+    void appendRaw( const uint8_t *data, DXT1Class dxt1Class = DXT1_NCLASSES,
+            const TileStats *stats = nullptr );
+
+    /*! Map the file into memory for reading.
+     *
+     * Tile reads are served straight from the mapping. Reads map the file
+     * on demand, calling this first only serves to provide the hint.
+     * @param advice the expected access pattern
+     * @return false if the file could not be mapped
+     */
+    bool mapFile( Advice advice = ADVICE_NORMAL );
+    void unmapFile();
+
+    /*! Get the encoded bytes of a tile.
+     *
+     * @param n tile index
+     * @return pointer to tileBytes of data, valid until the file is
+     * unmapped, written to, or the next call on the same thread when the
+     * file is not mapped. The part of a tile lying beyond the end of a
+     * truncated file reads as zero, with a warning. During a writer
+     * session tiles still waiting in the write buffer are read from it,
+     * and are valid until the next append.
+     *
+     * Concurrent reads are safe, but not reads alongside writes.
+     */
+    const uint8_t *getTileRaw( const uint32_t n );
+
+    /*! Decode many tiles into one contiguous block of memory.
+     *
+     * The requests are sorted so that runs of neighbouring tiles are read
+     * together. Tile k of the request is found at k * tileSpec.image_bytes()
+     * in the result.
+     */
+    std::vector< uint8_t > getTiles( const uint32_t first, const uint32_t count );
+    std::vector< uint8_t > getTiles( const std::vector< uint32_t > &indices );
+
+    /*! Decode many tiles into caller provided memory.
+     *
+     * @param indices tiles to decode
+     * @param dest destination for each tile, mipSpec( mip ).image_bytes()
+     * each
+     * @param mip the stored mip to decode
+     */
+    void getTiles( const std::vector< uint32_t > &indices, uint8_t * const *dest,
+            const uint32_t mip = 0 );
+
+    /*! Begin a writer session.
+     *
+     * Keeps the file open between appends and buffers the encoded tiles,
+     * writing them out in large blocks. The header is only written when
+     * the session ends.
+     * @param reserveTiles number of tiles expected to be appended, when
+     * non zero the file is preallocated to fit them.
+     */
+    void beginWrite( uint32_t reserveTiles = 0 );
+
+    /*! End the writer session.
+     *
+     * Flushes the buffered tiles, writes the header and trims any unused
+     * preallocated space from the end of the file.
+     */
+    void endWrite();
 };
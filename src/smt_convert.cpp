@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <iostream>
+#include <thread>
+#include <mutex>
 #include <unordered_map>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,7 +13,6 @@
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
 
-using OpenImageIO::ImageBufAlgo::computePixelHashSHA1;
 using OpenImageIO::TypeDesc;
 
 #include <elog.h>
@@ -20,6 +23,7 @@ using OpenImageIO::TypeDesc;
 #include "util.h"
 #include "tilecache.h"
 #include "tiledimage.h"
+#include "workqueue.h"
 
 enum optionsIndex
 {
@@ -36,6 +40,7 @@ enum optionsIndex
     IMAGESIZE,
     TILESIZE,
     FORMAT,
+    COMPRESS,
     TILEMAP,
 
     FILTER,
@@ -44,6 +49,11 @@ enum optionsIndex
     DUPLI,
     SMTOUT,
     IMGOUT,
+    INDEX,
+    CACHE,
+    PROBECACHE,
+    IMAGECACHE,
+    JOBS,
 };
 //FIXME what happened to specifying the span of input tiles?
 //FIXME now using output path and output name
@@ -51,6 +61,8 @@ const option::Descriptor usage[] = {
     { UNKNOWN, 0, "", "", Arg::None,
         "USAGE: smt_convert [options] <source1> [source2...sourceN]> \n"
         "  eg. 'smt_convert -o myfile.smt tilesource1.smt tilesource2.jpg'\n"
+        "  sources can be directories of tiles, or @file to read a list of\n"
+        "  sources from file, one per line.\n"
         "\nOPTIONS:"},
 
     { HELP,             0, "h", "help",       Arg::None,
@@ -85,6 +97,10 @@ const option::Descriptor usage[] = {
     { FORMAT,           0, "f", "format",     Arg::Required,
 "  -f  \t--format=[DXT1,RGBA8,USHORT]\t"
 "default=DXT1, what format to put into the smt"},
+    { COMPRESS,         0, "c", "compress",   Arg::Required,
+"  -c  \t--compress=[Fast,Adaptive,Best]\t"
+"default=Fast, dxt1 encoder, adaptive picks one per tile by colour "
+"variance and is slower" },
     { TILEMAP,          0, "M", "tilemap",        Arg::Required,
 "  -M  \t--tilemap=<csv|smf>\t"
 "Reconstruction tilemap." },
@@ -99,14 +115,31 @@ const option::Descriptor usage[] = {
     { BORDER,           0, "b", "border",   Arg::Numeric,
 "  -b  \t--border=0\t"
 "consider that each tile has a border of this width" },
+    { CACHE,            0, "", "cache",   Arg::Numeric,
+"  \t--cache=256\t"
+"MiB of memory to keep decoded source tiles in, 0 disables." },
+    { PROBECACHE,       0, "", "probecache",   Arg::Required,
+"  \t--probecache=<file>\t"
+"Remember what each source is in this file, so unchanged sources aren't "
+"opened again on the next run." },
+    { IMAGECACHE,       0, "", "imagecache",   Arg::Numeric,
+"  \t--imagecache=256\t"
+"MiB of memory to keep image sources in, they are read a tile at a time." },
+    { JOBS,             0, "j", "jobs",   Arg::Numeric,
+"  -j  \t--jobs=0\t"
+"Threads for each stage of the conversion, 0 uses one per core. Source "
+"tiles are prefetched on half as many." },
     { DUPLI,            0, "d", "dupli",   Arg::Required,
 "  -d  \t--dupli=[None,Exact,Perceptual]\t"
-"default=Exact, whether to detect and omit duplcates." },
+"default=Exact, whether to detect and omit duplcates. Perceptual only "
+"merges tiles of one colour for now." },
 
     { SMTOUT,           0, "", "smt", Arg::None,
       "\t--smt\t"              "Save tiles to smt file" },
     { IMGOUT,           0, "", "img", Arg::None,
       "\t--img\t"              "Save tiles as images" },
+    { INDEX,            0, "", "index", Arg::None,
+      "\t--index\t"            "Write a .idx sidecar with per tile hashes and stats" },
 
     { 0, 0, 0, 0, 0, 0 }
 };
@@ -119,7 +152,6 @@ main( int argc, char **argv )
     // temporary
     SMF *tempSMF = nullptr;
     SMT *tempSMT = nullptr;
-    std::stringstream name;
 
     // source
     TileCache src_tileCache;
@@ -128,6 +160,7 @@ main( int argc, char **argv )
     std::vector<uint32_t> src_filter;
     OpenImageIO::ImageSpec sSpec;
     uint32_t overlap = 0;
+    uint32_t nJobs = 0;
 
     // output
     std::string out_fileName = "output.smt";
@@ -238,6 +271,12 @@ main( int argc, char **argv )
         overlap = atoi( options[ OVERLAP ].arg );
     }
 
+    if( options[ JOBS ] ){
+        nJobs = atoi( options[ JOBS ].arg );
+    }
+    if(! nJobs ) nJobs = std::thread::hardware_concurrency();
+    if(! nJobs ) nJobs = 1;
+
     // * Duplicate Detection
     int dupli = 1;
     if( options[ DUPLI ] ){
@@ -245,6 +284,15 @@ main( int argc, char **argv )
         if( strcmp( options[ DUPLI ].arg, "Perceptual" ) == 0 ) dupli = 2;
     }
 
+    // * DXT1 encoder
+    SMT::Encoder encoder = SMT::ENCODER_FAST;
+    if( options[ COMPRESS ] ){
+        if( strcmp( options[ COMPRESS ].arg, "Adaptive" ) == 0 )
+            encoder = SMT::ENCODER_ADAPTIVE;
+        if( strcmp( options[ COMPRESS ].arg, "Best" ) == 0 )
+            encoder = SMT::ENCODER_BEST;
+    }
+
     // Output File Path
     struct stat info;
     if( options[ OUTPUT_PATH ] ){
@@ -268,10 +316,19 @@ main( int argc, char **argv )
     }
 
     // == TILE CACHE ==
+    if( options[ IMAGECACHE ] ){
+        src_tileCache.setImageCacheBytes(
+                (size_t)atoi( options[ IMAGECACHE ].arg ) << 20 );
+    }
+    if( options[ PROBECACHE ] ){
+        src_tileCache.setProbeCache( options[ PROBECACHE ].arg );
+    }
+    std::vector< std::string > src_fileNames;
     for( int i = 0; i < parse.nonOptionsCount(); ++i ){
         DLOG( INFO ) << "adding " << parse.nonOption( i ) << " to tilecache.";
-        src_tileCache.addSource( parse.nonOption( i ) );
+        src_fileNames.push_back( parse.nonOption( i ) );
     }
+    src_tileCache.addSources( src_fileNames );
     CHECK( src_tileCache.nTiles ) << "no tiles in cache";
     LOG( INFO ) << src_tileCache.nTiles << " tiles in cache";
 
@@ -336,6 +393,12 @@ main( int argc, char **argv )
 
     // == Build source TiledImage ==
     src_tiledImage.setTileMap( src_tileMap );
+    if( options[ CACHE ] ){
+        src_tileCache.setCacheBytes( (size_t)atoi( options[ CACHE ].arg ) << 20 );
+    }
+    // prefetching shares the cores with the fetch and compress stages,
+    // rather than adding a thread per core of its own
+    src_tileCache.setPrefetchThreads( std::max( 1u, nJobs / 2 ) );
     src_tiledImage.tileCache = src_tileCache;
     src_tiledImage.setTSpec( sSpec );
     src_tiledImage.setOverlap( overlap );
@@ -386,6 +449,21 @@ main( int argc, char **argv )
     float yratio = (float)src_tiledImage.getHeight() / (float)out_img_height;
     DLOG( INFO ) << "Scale Ratio: " << xratio << "x" << yratio;
 
+    // power of two reductions read the stored mips of smt tiles rather than
+    // decoding them at full size and scaling them down.
+    if( xratio == yratio && overlap == 0 ){
+        for( uint32_t lod = SMT::nMips - 1; lod > 0; --lod ){
+            uint32_t factor = 1 << lod;
+            if( xratio != factor || sSpec.width % factor || sSpec.height % factor ){
+                continue;
+            }
+            src_tiledImage.setLOD( lod );
+            xratio = yratio = 1;
+            LOG( INFO ) << "Reading sources at 1/" << factor << " size";
+            break;
+        }
+    }
+
     rel_tile_width = out_tileSpec.width * xratio;
     rel_tile_height = out_tileSpec.height * yratio;
     DLOG( INFO ) << "Pre-scaled tile: " << rel_tile_width << "x" << rel_tile_height;
@@ -395,63 +473,300 @@ main( int argc, char **argv )
         if(! tempSMT ) LOG( FATAL ) << "cannot overwrite existing file";
         tempSMT->setType( out_format );
         tempSMT->setTileSize( out_tileSpec.width );
+        tempSMT->setEncoder( encoder );
+        if( options[ INDEX ] ) tempSMT->setIndexed( true );
+        tempSMT->beginWrite( out_tileMap.width * out_tileMap.height );
     }
 
-    // tile hashtable for exact duplicate detection
-    std::unordered_map<std::string, int> hash_map;
-    int *item;
+    // Exact duplicate detection. The first tile fetched with each hash
+    // stands for every tile confirmed equal to it, fetch workers compare
+    // tiles with it byte for byte so that the ordering thread only has to
+    // number each of these groups when it first meets one in map order.
+    struct Representative {
+        uint64_t seq;
+        uint32_t x, y;
+        bool copied;
+    };
+    std::mutex hashMutex;
+    std::unordered_map< Hash128, Representative, Hash128Hasher > hash_map;
     hash_map.reserve(out_tileMap.width * out_tileMap.height);
+    std::unordered_map< uint64_t, uint32_t > group_map;
+    std::unordered_map< uint32_t, uint32_t > solid_map;
+    int numSolid = 0;
+
+    // When the source tiles map one to one onto the output tiles there is
+    // no need to decode and recompress dxt1 tiles, they can be copied.
+    bool passthrough = options[ SMTOUT ] && out_format == 1 && overlap == 0
+        && src_tiledImage.lod == 0
+        && out_tileSpec.width == out_tileSpec.height
+        && sSpec.width == out_tileSpec.width
+        && sSpec.height == out_tileSpec.height
+        && rel_tile_width == (uint32_t)out_tileSpec.width
+        && rel_tile_height == (uint32_t)out_tileSpec.height;
+    int numCopied = 0;
 
     // == OUTPUT THE IMAGES ==
+    // Tiles pass through stages joined by bounded queues. Fetch workers
+    // assemble tiles in any order and confirm which are equal, duplicates
+    // are numbered in map order on this thread, compress workers scale and encode the unique tiles and a
+    // writer appends them in tile order. Everything that depends on earlier
+    // tiles happens in order, so the output matches a serial conversion.
+    struct Tile {
+        uint32_t x = 0, y = 0;
+        bool copied = false;
+        bool solid = false;
+        uint8_t colour[ 4 ];
+        Hash128 hash;                   //!< of raw when copied, else buf
+        uint64_t group = 0;             //!< seq of the tile standing for it
+        std::vector< uint8_t > raw;     //!< encoded tile
+        bool encoded = false;
+        DXT1Class dxt1Class = DXT1_NCLASSES;
+        SMT::TileStats stats;           //!< index entry, when indexed
+        std::unique_ptr< OpenImageIO::ImageBuf > buf;
+        uint32_t number = 0;            //!< position in the output
+    };
+    typedef std::unique_ptr< Tile > TilePtr;
+
+    const uint64_t nSplits = (uint64_t)out_tileMap.width * out_tileMap.height;
+    const size_t depth = 16 * nJobs;
+    OrderedQueue< TilePtr > fetched( depth );
+    WorkQueue< TilePtr > compressQueue( depth );
+    OrderedQueue< TilePtr > written( depth );
+
+    // index entries are computed by the workers, not the writer
+    const bool indexed = tempSMT && tempSMT->isIndexed();
     int numTiles = 0;
     int numDupes = 0;
-    OpenImageIO::ROI roi = OpenImageIO::ROI::All();
-    std::unique_ptr< OpenImageIO::ImageBuf > out_buf;
-    for( uint32_t y = 0; y < out_tileMap.height; ++y ) {
-        for( uint32_t x = 0; x < out_tileMap.width; ++x ){
-            DLOG( INFO ) << "Processing split (" << x << ", " << y << ")";
-
-            roi.xbegin = x * rel_tile_width;
-            roi.xend   = x * rel_tile_width + rel_tile_width;
-            roi.ybegin = y * rel_tile_height;
-            roi.yend   = y * rel_tile_height + rel_tile_height;
-            out_buf = src_tiledImage.getRegion( roi );
-
-            if( dupli == 1 ){
-                item = &hash_map[ computePixelHashSHA1( *out_buf ) ];
-                if( *item ){
-                    out_tileMap( x, y ) = *item;
-                    ++numDupes;
-                    continue;
+    // the source tiles of the next row of output tiles are decoded in the
+    // background while the current row is worked on.
+    auto prefetchRow = [&]( uint32_t y ){
+        if( passthrough || y >= out_tileMap.height ) return;
+        src_tiledImage.prefetchRegion( OpenImageIO::ROI(
+            0, out_tileMap.width * rel_tile_width,
+            y * rel_tile_height, (y + 1) * rel_tile_height ) );
+    };
+
+    // the region of the source read for an output tile
+    auto splitROI = [&]( uint32_t x, uint32_t y ){
+        OpenImageIO::ROI roi = OpenImageIO::ROI::All();
+        roi.xbegin = x * rel_tile_width;
+        roi.xend   = x * rel_tile_width + rel_tile_width;
+        roi.ybegin = y * rel_tile_height;
+        roi.yend   = y * rel_tile_height + rel_tile_height;
+        return roi;
+    };
+
+    // region buffers are handed back once a tile is done with them, so that
+    // fetching regions of the same size again allocates nothing
+    std::mutex spareMutex;
+    std::vector< std::unique_ptr< OpenImageIO::ImageBuf > > spareBufs;
+    auto takeBuf = [&](){
+        std::lock_guard< std::mutex > lock( spareMutex );
+        if( spareBufs.empty() ){
+            return std::unique_ptr< OpenImageIO::ImageBuf >( new OpenImageIO::ImageBuf );
+        }
+        std::unique_ptr< OpenImageIO::ImageBuf > buf = std::move( spareBufs.back() );
+        spareBufs.pop_back();
+        return buf;
+    };
+    auto giveBuf = [&]( std::unique_ptr< OpenImageIO::ImageBuf > buf ){
+        if(! buf ) return;
+        std::lock_guard< std::mutex > lock( spareMutex );
+        spareBufs.push_back( std::move( buf ) );
+    };
+
+    // tiles with equal hashes are compared byte for byte, reading the
+    // representative again rather than holding on to every unique tile.
+    auto sameTile = [&]( const Tile &tile, const Representative &first ){
+        if( tile.copied != first.copied ) return false;
+        if( tile.copied ){
+            std::vector< uint8_t > raw;
+            return src_tileCache.getTileDXT1(
+                    src_tiledImage.tileMap( first.x, first.y ),
+                    out_tileSpec.width, raw ) && raw == tile.raw;
+        }
+        std::unique_ptr< OpenImageIO::ImageBuf > buf = takeBuf();
+        src_tiledImage.getRegion( splitROI( first.x, first.y ), *buf );
+        size_t bytes = tile.buf->spec().image_bytes();
+        bool same = buf->spec().image_bytes() == bytes
+            && ! memcmp( buf->localpixels(), tile.buf->localpixels(), bytes );
+        giveBuf( std::move( buf ) );
+        return same;
+    };
+
+    // assemble a tile, and anything about it that needs no other tile
+    std::atomic< uint64_t > nextSplit( 0 );
+    auto fetch = [&](){
+        for( uint64_t seq = nextSplit++; seq < nSplits; seq = nextSplit++ ){
+            TilePtr tile( new Tile );
+            tile->x = seq % out_tileMap.width;
+            tile->y = seq / out_tileMap.width;
+            if( tile->x == 0 ) prefetchRow( tile->y + 1 );
+            DLOG( INFO ) << "Processing split (" << tile->x << ", " << tile->y << ")";
+
+            if( passthrough
+             && tile->x < src_tiledImage.tileMap.width
+             && tile->y < src_tiledImage.tileMap.height ){
+                uint32_t index = src_tiledImage.tileMap( tile->x, tile->y );
+                tile->copied = index < src_tileCache.nTiles
+                    && src_tileCache.getTileDXT1( index, out_tileSpec.width,
+                            tile->raw );
+            }
+
+            if(! tile->copied ){
+                tile->buf = takeBuf();
+                src_tiledImage.getRegion( splitROI( tile->x, tile->y ), *tile->buf );
+            }
+
+            // uniform tiles are encoded from a table and deduplicated on
+            // their colour, skipping the scale and the hash.
+            tile->solid = ! tile->copied && options[ SMTOUT ] && ! options[ IMGOUT ]
+                && solid_colour( *tile->buf, tile->colour );
+            if( tile->solid ){
+                tile->raw.resize( tempSMT->tileBytes );
+                tile->solid = tempSMT->encodeSolid( tile->colour, tile->raw.data() );
+                if( out_format == 1 ) tile->dxt1Class = DXT1_SOLID;
+            }
+            if( indexed && (tile->copied || tile->solid) ){
+                tile->stats = tempSMT->tileStats( tile->raw.data() );
+            }
+            if( tile->solid ) giveBuf( std::move( tile->buf ) );
+
+            // copied tiles are compared on their encoded bytes. A tile that
+            // differs from the representative of its hash stands for itself.
+            if( dupli == 1 && ! tile->solid ){
+                tile->hash = tile->copied
+                    ? hash128( tile->raw.data(), tile->raw.size() )
+                    : hash128( tile->buf->localpixels(), tile->buf->spec().image_bytes() );
+                tile->group = seq;
+                Representative first{ seq, tile->x, tile->y, tile->copied };
+                {
+                    std::lock_guard< std::mutex > lock( hashMutex );
+                    auto found = hash_map.emplace( tile->hash, first );
+                    if(! found.second ) first = found.first->second;
                 }
-                else {
-                    *item = numTiles;
+                if( first.seq != seq && sameTile( *tile, first ) ){
+                    tile->group = first.seq;
                 }
             }
+            fetched.push( seq, std::move( tile ) );
+        }
+    };
 
-            // scale according to out_tileSpec, which is conditionally defined by
-            // --tilesize or --imagesize depending on whether one image is
-            // being exported or whether to split up into chunks.
-            out_buf = fix_scale( std::move( out_buf ), out_tileSpec );
+    // scale according to out_tileSpec, which is conditionally defined by
+    // --tilesize or --imagesize depending on whether one image is
+    // being exported or whether to split up into chunks.
+    auto compress = [&](){
+        TilePtr tile;
+        while( compressQueue.pop( tile ) ){
+            tile->buf = fix_scale( std::move( tile->buf ), out_tileSpec );
 
-            if( options[ SMTOUT ] ) tempSMT->append( *out_buf );
             if( options[ IMGOUT ] ){
-                name << out_fileDir << out_fileName << "." << std::setfill('0') << std::setw(6) << numTiles << ".tif";
-                out_buf->write( name.str() );
-                name.str( std::string() );
+                std::stringstream name;
+                name << out_fileDir << out_fileName << "." << std::setfill('0') << std::setw(6) << tile->number << ".tif";
+                tile->buf->write( name.str() );
             }
-            out_tileMap(x,y) = numTiles;
-            ++numTiles;
+            if( options[ SMTOUT ] ){
+                tile->raw.resize( tempSMT->tileBytes );
+                tile->encoded = tempSMT->encode( *tile->buf, tile->raw.data(),
+                        &tile->dxt1Class );
+                if( tile->encoded && indexed ){
+                    tile->stats = tempSMT->tileStats( tile->raw.data() );
+                }
+            }
+            giveBuf( std::move( tile->buf ) );
+            written.push( tile->number, std::move( tile ) );
+        }
+    };
+
+    // a null tile marks the end
+    auto write = [&](){
+        for( TilePtr tile = written.pop(); tile; tile = written.pop() ){
+            if( tile->encoded ) tempSMT->appendRaw( tile->raw.data(),
+                    tile->dxt1Class, indexed ? &tile->stats : nullptr );
+        }
+    };
 
-            if( options[ PROGRESS ] ){
-                progressBar( "[Progress]:",
-                    out_tileMap.width * out_tileMap.height - numDupes,
-                    numTiles );
+    prefetchRow( 0 );
+    std::vector< std::thread > threads;
+    for( uint32_t i = 0; i < nJobs; ++i ){
+        threads.emplace_back( fetch );
+        threads.emplace_back( compress );
+    }
+    threads.emplace_back( write );
+
+    for( uint64_t seq = 0; seq < nSplits; ++seq ){
+        TilePtr tile = fetched.pop();
+        uint32_t x = tile->x, y = tile->y;
+
+        // tiles of one colour match exactly or not at all, so they are
+        // merged in Perceptual mode as well as Exact
+        if( tile->solid && dupli ){
+            uint32_t key;
+            memcpy( &key, tile->colour, 4 );
+            auto found = solid_map.find( key );
+            if( found != solid_map.end() ){
+                out_tileMap( x, y ) = found->second;
+                ++numDupes;
+                continue;
+            }
+            solid_map[ key ] = numTiles;
+        }
+        else if( dupli == 1 ){
+            // the first of a group in map order is written, whichever tile
+            // of it was fetched first
+            auto found = group_map.find( tile->group );
+            if( found != group_map.end() ){
+                out_tileMap( x, y ) = found->second;
+                ++numDupes;
+                giveBuf( std::move( tile->buf ) );
+                continue;
             }
+            group_map[ tile->group ] = numTiles;
+        }
+
+        tile->number = numTiles;
+        out_tileMap(x,y) = numTiles;
+        ++numTiles;
+        if( tile->copied || tile->solid ){
+            if( tile->copied ) ++numCopied;
+            if( tile->solid ) ++numSolid;
+            tile->encoded = true;
+            written.push( tile->number, std::move( tile ) );
+        }
+        else {
+            compressQueue.push( std::move( tile ) );
+        }
+
+        if( options[ PROGRESS ] ){
+            progressBar( "[Progress]:",
+                out_tileMap.width * out_tileMap.height - numDupes,
+                numTiles );
         }
     }
+    compressQueue.close();
+    written.push( numTiles, nullptr );
+    for( auto &thread : threads ) thread.join();
+
+    if( options[ SMTOUT ] ){
+        tempSMT->endWrite();
+        if( out_format == 1 ){
+            LOG( INFO ) << "dxt1 tile classes solid:flat:smooth:detailed = "
+                << tempSMT->classCount( DXT1_SOLID ) << ":"
+                << tempSMT->classCount( DXT1_FLAT ) << ":"
+                << tempSMT->classCount( DXT1_SMOOTH ) << ":"
+                << tempSMT->classCount( DXT1_DETAILED );
+        }
+        delete tempSMT;
+    }
+
     LOG(INFO) << "actual:max = " << numTiles << ":" << out_tileMap.width * out_tileMap.height;
     LOG(INFO) << "number of dupes = " << numDupes;
+    LOG(INFO) << "number of tiles copied without recompression = " << numCopied;
+    LOG(INFO) << "number of solid colour tiles = " << numSolid;
+    TileLRU::Stats cacheStats = src_tiledImage.tileCache.cacheStats();
+    LOG(INFO) << "tile cache hits:misses:evictions = " << cacheStats.hits
+        << ":" << cacheStats.misses << ":" << cacheStats.evictions;
 
     // if the tileMap only contains 1 value, then we are only outputting
     //     a single image, so skip tileMap csv export
@@ -1,9 +1,19 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <elog.h>
 
 #include "option_args.h"
 #include "smt.h"
+#include "util.h"
 
 enum optionsIndex
 {
@@ -11,13 +21,15 @@ enum optionsIndex
     // General Options
     HELP, VERBOSE, QUIET,
     // File Operations
-    IFILE, OVERWRITE
+    IFILE, OVERWRITE,
+    // Verification
+    VERIFY, TRUNCATE, INDEX
 };
 
 const option::Descriptor usage[] = {
     { UNKNOWN, 0, "", "", Arg::None,
-        "USAGE: smt_cc [options] [source files] \n"
-        "  eg. 'smt_cc -v -f mysmt.smt *.jpg'\n"
+        "USAGE: smt_repair [options] <file.smt> \n"
+        "  eg. 'smt_repair -v --verify --truncate mysmt.smt'\n"
         "\nGENERAL OPTIONS:" },
     { HELP, 0, "h", "help", Arg::None,
         "  -h,  \t--help  \tPrint usage and exit." },
@@ -30,9 +42,19 @@ const option::Descriptor usage[] = {
     { IFILE, 0, "o", "file", Arg::Required,
         "  -f,  \t--file=filename.smt  \tfile to operate on, will be created "
             "if it doesnt exist." },
+    { VERIFY, 0, "", "verify", Arg::None,
+        "  \t--verify  \tdecode every mip of every tile and report problems, "
+            "without changing the file unless asked to. Tiles are also "
+            "checked against the .idx sidecar when it matches the file." },
+    { TRUNCATE, 0, "", "truncate", Arg::None,
+        "  \t--truncate  \tremove a partial tile from the end of the file, "
+            "and any tiles past the count in its header." },
+    { INDEX, 0, "", "index", Arg::None,
+        "  \t--index  \trebuild the .idx sidecar index." },
     { UNKNOWN, 0, "", "", Arg::None,
         "\nEXAMPLES:\n"
-        "  smt_cc \n"
+        "  smt_repair mysmt.smt\n"
+        "  smt_repair --verify --truncate --index mysmt.smt\n"
     },
     { 0, 0, 0, 0, 0, 0 }
 };
@@ -91,18 +113,132 @@ main( int argc, char **argv )
     }
     LOG( INFO ) << smt->info();
 
-    std::fstream inFile( parse.nonOption( 0 ), std::ios::in );
-    inFile.seekg( 0, std::ios::end );
-    int inSize = inFile.tellg();
-    inFile.close();
-
+    std::string fileName = parse.nonOption( 0 );
+    struct stat st;
+    CHECK(! stat( fileName.c_str(), &st ) ) << "unable to stat " << fileName;
+    uint64_t inSize = st.st_size;
     LOG( INFO ) << inSize << " bytes";
-    int tiles = (inSize - 32) / smt->tileBytes;
+    CHECK( inSize >= sizeof( SMT::Header ) ) << fileName << " is too small";
+
+    uint64_t dataBytes = inSize - sizeof( SMT::Header );
+    // the header counts tiles in 32 bits
+    uint64_t fileTiles = dataBytes / smt->tileBytes;
+    if( fileTiles > UINT32_MAX ){
+        LOG( ERROR ) << fileName << " holds " << fileTiles
+            << " tiles, more than the header can count";
+        exit( 1 );
+    }
+    uint32_t tiles = fileTiles;
+    uint64_t partialBytes = dataBytes % smt->tileBytes;
     LOG( INFO ) << tiles << " tiles";
-    inFile.open( parse.nonOption( 0 ), std::ios::out | std::ios::in );
+    if( partialBytes ){
+        LOG( WARN ) << "truncated trailing tile of " << partialBytes << " bytes";
+    }
+    if( tiles != smt->nTiles ){
+        LOG( WARN ) << "header claims " << smt->nTiles << " tiles, file holds " << tiles;
+    }
+
+    // Verification
+    // ============
+    // The file is scanned in chunks of tiles shared between threads,
+    // straight from a read only mapping.
+    if( options[ VERIFY ] && tiles ){
+        int fd = open( fileName.c_str(), O_RDONLY );
+        CHECK( fd >= 0 ) << "unable to open " << fileName;
+        void *map = mmap( nullptr, inSize, PROT_READ, MAP_SHARED, fd, 0 );
+        close( fd );
+        CHECK( map != MAP_FAILED ) << "unable to map " << fileName;
+        madvise( map, inSize, MADV_SEQUENTIAL );
+
+        const uint8_t *data = (const uint8_t *)map + sizeof( SMT::Header );
+        const uint32_t chunkTiles = 4096;
+        std::vector< uint32_t > warnings( tiles );
+        // open() only keeps an index written for a file of this size, so
+        // any tile whose hash differs has changed on disk since
+        const std::vector< SMT::TileStats > &index = smt->index;
+        std::vector< char > changed( tiles, false );
+        std::atomic< uint32_t > next( 0 );
+        auto worker = [&](){
+            for( uint64_t chunk = next++; chunk * chunkTiles < tiles; chunk = next++ ){
+                uint32_t begin = chunk * chunkTiles;
+                uint32_t end = std::min< uint64_t >( tiles, begin + chunkTiles );
+                for( uint32_t i = begin; i < end; ++i ){
+                    const uint8_t *tile = data + (uint64_t)smt->tileBytes * i;
+                    warnings[ i ] = smt->verifyTile( tile );
+                    changed[ i ] = i < index.size()
+                        && hash64( tile, smt->tileBytes ) != index[ i ].hash;
+                }
+            }
+        };
+        uint32_t nThreads = std::max( 1u, std::thread::hardware_concurrency() );
+        std::vector< std::thread > threads;
+        for( uint32_t i = 1; i < nThreads; ++i ) threads.emplace_back( worker );
+        worker();
+        for( auto &thread : threads ) thread.join();
+        munmap( map, inSize );
+
+        uint32_t counts[ 3 ] = { 0, 0, 0 };
+        uint32_t numChanged = 0;
+        for( uint32_t i = 0; i < tiles; ++i ){
+            if( changed[ i ] ){
+                ++numChanged;
+                LOG( INFO ) << "tile " << i << ": differs from the index";
+            }
+            if(! warnings[ i ] ) continue;
+            for( int bit = 0; bit < 3; ++bit ) counts[ bit ] += (warnings[ i ] >> bit) & 1;
+            LOG( INFO ) << "tile " << i << ":"
+                << (warnings[ i ] & SMT::WARN_EMPTY ? " empty" : "")
+                << (warnings[ i ] & SMT::WARN_TRANSPARENT ? " transparent" : "")
+                << (warnings[ i ] & SMT::WARN_MIPS ? " mips" : "");
+        }
+        // content depends on the encoder and the map, so none of this is
+        // repaired. Black dxt1 tiles are all zero just like unwritten ones.
+        LOG( WARN ) << "verified " << tiles << " tiles, warnings only:"
+            << "\n\tempty:\033[40G" << counts[ 0 ]
+            << "\n\ttransparent blocks:\033[40G" << counts[ 1 ]
+            << "\n\tmips unlike a box filter:\033[40G" << counts[ 2 ];
+        if(! index.empty() ){
+            LOG( WARN ) << "tiles changed since " << smt->indexFileName()
+                << " was written:\033[40G" << numChanged;
+        }
+    }
+
+    // Repair
+    // ======
+    // without --verify the tool only corrects the tile count, as it always has
+    bool readOnly = options[ VERIFY ] && ! (options[ TRUNCATE ] || options[ INDEX ]);
+    if( readOnly ){
+        delete smt;
+        delete[] options;
+        delete[] buffer;
+        exit( 0 );
+    }
+
+    // tiles past the count in the header are left over preallocation, and
+    // are cut along with any partial tile. What the tiles hold has no say,
+    // a tile of zeros may well be black.
+    if( options[ TRUNCATE ] ){
+        tiles = std::min( tiles, smt->nTiles );
+        uint64_t bytes = sizeof( SMT::Header ) + (uint64_t)smt->tileBytes * tiles;
+        LOG( INFO ) << "truncating to " << tiles << " tiles, " << bytes << " bytes";
+        CHECK(! truncate( fileName.c_str(), bytes ) ) << "unable to truncate " << fileName;
+    }
+
+    std::fstream inFile( fileName, std::ios::out | std::ios::in | std::ios::binary );
     inFile.seekp(20);
     inFile.write( (char *)&tiles, 4 );
     inFile.close();
+    delete smt;
+
+    // reopen with the corrected header
+    smt = SMT::open( fileName );
+    CHECK( smt ) << "unable to reopen " << fileName;
+
+    if( options[ INDEX ] ){
+        smt->buildIndex();
+        LOG( INFO ) << "wrote " << smt->indexFileName();
+    }
+    delete smt;
 
 // fix file
 // output file
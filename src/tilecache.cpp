@@ -1,101 +1,428 @@
+#include <algorithm>
 #include <string>
+#include <map>
+#include <fstream>
+#include <cstring>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
 #include <elog.h>
 
 #include "smf_tools.h"
-#ifdef IMG_DEBUG
-#include <sstream>
-#endif
 
 #include "util.h"
-#include "smt.h"
-#include "smf.h"
 #include "tilecache.h"
 
+// identifies the pixel layout a tile was decoded to
+static uint64_t
+specSignature( const OpenImageIO::ImageSpec &spec )
+{
+    return (uint64_t)spec.width | ((uint64_t)spec.height << 16)
+        | ((uint64_t)spec.nchannels << 32)
+        | ((uint64_t)spec.format.basetype << 40);
+}
+
+// tiles decoded at different sizes, such as the stored mips of smt tiles,
+// are cached alongside each other
+static uint64_t
+tileKey( const uint32_t n, const OpenImageIO::ImageSpec &spec )
+{
+    return ((uint64_t)spec.width << 32) | n;
+}
+
+size_t
+TileCache::findSource( const uint32_t n, uint32_t &first ) const
+{
+    if( singleTileSources ){
+        first = n;
+        return n;
+    }
+
+    // the last source starting at or before n
+    auto source = std::upper_bound( sources.begin(), sources.end(), n,
+        []( uint32_t n, const Source &s ){ return n < s.first; } ) - 1;
+    first = source->first;
+    return source - sources.begin();
+}
+
 std::unique_ptr< OpenImageIO::ImageBuf >
-//FIXME remove the 2 once all is said and done
 TileCache::getTile(const uint32_t n)
 {
-    std::unique_ptr< OpenImageIO::ImageBuf >
-        outBuf( new OpenImageIO::ImageBuf );
-
     // returning an unitialized imagebuf is not a good idea
     CHECK( n < nTiles ) << "getTile( " << n << ") request out of range 0-" << nTiles ;
 
-    SMT *smt = nullptr;
-    static SMT *lastSmt = nullptr;
+    uint32_t first;
+    const Source &source = sources[ findSource( n, first ) ];
+    std::unique_ptr< OpenImageIO::ImageBuf >
+        outBuf = source.source->getTile( n - first );
+    CHECK( outBuf && outBuf->initialized() )
+        << "failed to open source for tile: " << n;
+
+#ifdef DEBUG_IMG
+    DLOG( INFO ) << "Exporting Image";
+    outBuf->write( "TileCache.getTile.tif" , "tif" );
+#endif
+
+    return outBuf;
+}
+
+bool
+TileCache::getTileDXT1( const uint32_t n, const uint32_t tileSize,
+        std::vector< uint8_t > &blocks )
+{
+    CHECK( n < nTiles ) << "getTileDXT1( " << n << ") request out of range 0-" << nTiles ;
+
+    uint32_t first;
+    const Source &source = sources[ findSource( n, first ) ];
+    return source.source->getTileDXT1( n - first, tileSize, blocks );
+}
 
-    // FIXME, what the fuck does this do?
-    auto i = map.begin();
-    auto fileName = fileNames.begin();
-    while( *i <= n ){
-        ++i;
-        ++fileName;
+std::vector< uint8_t >
+TileCache::getTiles( const std::vector< uint32_t > &indices,
+        const OpenImageIO::ImageSpec &spec )
+{
+    size_t pixelBytes = spec.image_bytes();
+    std::vector< uint8_t > arena( pixelBytes * indices.size() );
+    std::vector< uint8_t * > dest( indices.size() );
+    for( size_t k = 0; k < indices.size(); ++k ){
+        dest[ k ] = arena.data() + pixelBytes * k;
     }
+    getTiles( indices, spec, dest.data() );
+    return arena;
+}
 
-    // already open smt file?
-    if( lastSmt && (! lastSmt->fileName.compare( *fileName )) ){
-        outBuf = lastSmt->getTile( n - *i + lastSmt->nTiles);
+void
+TileCache::getTiles( const std::vector< uint32_t > &indices,
+        const OpenImageIO::ImageSpec &spec, uint8_t * const *dest, bool keep )
+{
+    size_t pixelBytes = spec.image_bytes();
+    uint64_t signature = specSignature( spec );
+
+    // group the requests that miss the decoded tile cache by source
+    struct Request {
+        std::vector< uint32_t > indices;
+        std::vector< uint8_t * > dest;
+    };
+    std::map< size_t, Request > requests;
+    std::vector< size_t > missed;
+    for( size_t k = 0; k < indices.size(); ++k ){
+        CHECK( indices[ k ] < nTiles ) << "getTiles( " << indices[ k ]
+            << ") request out of range 0-" << nTiles;
+        if( _lru.budget() ){
+            TileLRU::Pixels pixels = _lru.find( tileKey( indices[ k ], spec ), signature );
+            if( pixels ){
+                memcpy( dest[ k ], pixels->data(), pixelBytes );
+                continue;
+            }
+            if( keep ) missed.push_back( k );
+        }
+        uint32_t first;
+        Request &request = requests[ findSource( indices[ k ], first ) ];
+        request.indices.push_back( indices[ k ] - first );
+        request.dest.push_back( dest[ k ] );
     }
-    // open a new smt file?
-    else if  ( (smt = SMT::open( *fileName )) ){
-        //FIXME shouldnt have a manual delete here, use move scemantics instead
-        delete lastSmt;
-        lastSmt = smt;
-        outBuf = lastSmt->getTile( n - *i + lastSmt->nTiles );
+
+    for( auto &i : requests ){
+        Request &request = i.second;
+        bool read = sources[ i.first ].source->getTiles(
+                request.indices, spec, request.dest.data() );
+        CHECK( read ) << "failed to read tiles from "
+            << sources[ i.first ].source->fileName;
     }
-    // open the image file?
-    else {
-        outBuf->reset( *fileName );
+
+    for( auto k : missed ){
+        const uint8_t *pixels = dest[ k ];
+        _lru.insert( tileKey( indices[ k ], spec ), signature, std::make_shared< std::vector< uint8_t > >(
+                pixels, pixels + pixelBytes ) );
     }
-    CHECK( outBuf->initialized() ) << "failed to open source for tile: " << n;
+}
 
-#ifdef DEBUG_IMG
-    DLOG( INFO ) << "Exporting Image";
-    outBuf->write( "TileCache.getTile.tif" , "tif" );
-#endif
+TileCache::TileCache() :
+    _imageCache( OpenImageIO::ImageCache::create( true ) )
+{
+    // untiled images are cached in tiles too, rather than whole
+    _imageCache->attribute( "autotile", 64 );
+}
 
-    return outBuf;
+void
+TileCache::setImageCacheBytes( size_t bytes )
+{
+    _imageCache->attribute( "max_memory_MB", (float)bytes / (1 << 20) );
+}
+
+bool
+TileCache::readTile( const uint32_t n, const OpenImageIO::ImageSpec &spec,
+        uint8_t *dest )
+{
+    uint32_t first;
+    const Source &source = sources[ findSource( n, first ) ];
+    return source.source->getTiles( { n - first }, spec, &dest );
+}
+
+TileCache::~TileCache()
+{
+    stopPrefetch();
 }
 
-//TODO go over this function to see if it can be refactored
 void
-TileCache::addSource( const std::string fileName )
+TileCache::prefetch( const std::vector< uint32_t > &indices,
+        const OpenImageIO::ImageSpec &spec )
+{
+    if(! _lru.budget() || indices.empty() ) return;
+
+    std::lock_guard< std::mutex > lock( _prefetchMutex );
+    if( _prefetchWorkers.empty() ){
+        _prefetchStop = false;
+        uint32_t nThreads = _prefetchThreads;
+        if(! nThreads ) nThreads = std::thread::hardware_concurrency();
+        if(! nThreads ) nThreads = 1;
+        for( uint32_t i = 0; i < nThreads; ++i ){
+            _prefetchWorkers.emplace_back( &TileCache::prefetchWorker, this );
+        }
+    }
+
+    if( specSignature( spec ) != specSignature( _prefetchSpec ) ){
+        _prefetchQueue.clear();
+        _prefetchQueued.clear();
+        _prefetchSpec = spec;
+    }
+    size_t capacity = std::max< size_t >( 1, _lru.budget() / spec.image_bytes() );
+    for( auto i : indices ){
+        if( _prefetchQueue.size() >= capacity ) break;
+        if( i < nTiles && _prefetchQueued.insert( i ).second ){
+            _prefetchQueue.push_back( i );
+        }
+    }
+    _prefetchWake.notify_all();
+}
+
+void
+TileCache::stopPrefetch()
+{
+    {
+        std::lock_guard< std::mutex > lock( _prefetchMutex );
+        _prefetchStop = true;
+        _prefetchQueue.clear();
+        _prefetchQueued.clear();
+    }
+    _prefetchWake.notify_all();
+    for( auto &thread : _prefetchWorkers ) thread.join();
+    _prefetchWorkers.clear();
+}
+
+void
+TileCache::prefetchWorker()
 {
     OIIO_NAMESPACE_USING;
-    ImageInput *image = nullptr;
-    if( (image = ImageInput::open( fileName )) ){
-        image->close();
-        delete image;
-
-        _nTiles++;
-        map.push_back( nTiles );
-        fileNames.push_back( fileName );
-        return;
+    std::vector< uint8_t > pixels;
+
+    while( true ){
+        uint32_t n;
+        ImageSpec spec;
+        {
+            std::unique_lock< std::mutex > lock( _prefetchMutex );
+            _prefetchWake.wait( lock, [this](){
+                return _prefetchStop || ! _prefetchQueue.empty(); } );
+            if( _prefetchStop ) return;
+            n = _prefetchQueue.front();
+            _prefetchQueue.pop_front();
+            _prefetchQueued.erase( n );
+            spec = _prefetchSpec;
+        }
+
+        uint64_t signature = specSignature( spec );
+        if( _lru.contains( tileKey( n, spec ), signature ) ) continue;
+
+        pixels.resize( spec.image_bytes() );
+        if(! readTile( n, spec, pixels.data() ) ) continue;
+        _lru.insert( tileKey( n, spec ), signature,
+                std::make_shared< std::vector< uint8_t > >( pixels ) );
     }
+}
 
-    SMT *smt = nullptr;
-    if( (smt = SMT::open( fileName )) ){
-        if(! smt->nTiles ) return;
-        _nTiles += smt->nTiles;
-        map.push_back( nTiles );
-        fileNames.push_back( fileName );
+// what a source file was found to be, as recorded in the probe cache
+enum ProbeKind { PROBE_NONE, PROBE_IMAGE };
+
+struct Probe {
+    ProbeKind kind = PROBE_NONE;
+    // size and modification time of the file when it was probed
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::shared_ptr< TileSource > source;
+};
+
+static bool
+statFile( const std::string &fileName, uint64_t &size, int64_t &mtime )
+{
+    struct stat st;
+    if( stat( fileName.c_str(), &st ) ) return false;
+    size = st.st_size;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// Expand directories to the files within them in name order, and
+// manifests to the sources they list.
+static void
+expandSources( const std::string &fileName, std::vector< std::string > &out )
+{
+    if( fileName[ 0 ] == '@' ){
+        std::string manifest = fileName.substr( 1 );
+        std::ifstream file( manifest );
+        if(! file.good() ){
+            LOG( ERROR ) << "unable to read manifest: " << manifest;
+            return;
+        }
+        // relative entries are relative to the manifest
+        size_t slash = manifest.find_last_of( '/' );
+        std::string base = slash == std::string::npos
+            ? "" : manifest.substr( 0, slash + 1 );
+        std::string line;
+        while( std::getline( file, line ) ){
+            if( line.empty() || line[ 0 ] == '#' ) continue;
+            if( line[ 0 ] != '/' && line[ 0 ] != '@' ) line = base + line;
+            expandSources( line, out );
+        }
+        return;
+    }
 
-        delete smt;
+    struct stat st;
+    if( stat( fileName.c_str(), &st ) || ! S_ISDIR( st.st_mode ) ){
+        out.push_back( fileName );
         return;
     }
 
-    SMF *smf = nullptr;
-    if( (smf = SMF::open( fileName )) ){
-        // get the fileNames here
-        auto smtList = smf->getSMTList();
-        for( auto i : smtList ) addSource( i.second );
-        delete smf;
+    DIR *dir = opendir( fileName.c_str() );
+    if(! dir ){
+        LOG( ERROR ) << "unable to read directory: " << fileName;
         return;
     }
+    std::vector< std::string > names;
+    while( struct dirent *entry = readdir( dir ) ){
+        std::string name = entry->d_name;
+        // hidden files and smt index sidecars are not sources
+        if( name[ 0 ] == '.' ) continue;
+        if( name.size() > 4 && ! name.compare( name.size() - 4, 4, ".idx" ) ){
+            continue;
+        }
+        names.push_back( name );
+    }
+    closedir( dir );
+
+    std::sort( names.begin(), names.end() );
+    std::string base = fileName.back() == '/' ? fileName : fileName + '/';
+    for( auto &name : names ) out.push_back( base + name );
+}
+
+void
+TileCache::addSource( const std::string fileName )
+{
+    addSources( { fileName }, 1 );
+}
+
+void
+TileCache::addSources( const std::vector< std::string > &fileNames,
+        uint32_t nThreads )
+{
+    // the prefetch threads read the source list
+    stopPrefetch();
+
+    std::vector< std::string > files;
+    for( auto &fileName : fileNames ) expandSources( fileName, files );
+
+    // results of the previous run, keyed by file name
+    std::map< std::string, Probe > cached;
+    if(! _probeCache.empty() ){
+        std::ifstream file( _probeCache );
+        std::string line;
+        while( std::getline( file, line ) ){
+            if( line.empty() || line[ 0 ] == '#' ) continue;
+            std::istringstream fields( line );
+            int kind;
+            Probe probe;
+            fields >> kind >> probe.size >> probe.mtime;
+            fields.get();
+            std::string name;
+            std::getline( fields, name );
+            if( fields.fail() || kind < PROBE_NONE || kind > PROBE_IMAGE ){
+                continue;
+            }
+            probe.kind = (ProbeKind)kind;
+            cached[ name ] = probe;
+        }
+    }
+
+    // probe the headers in parallel, images and unrecognised files that
+    // haven't changed since the last run aren't opened at all.
+    std::vector< Probe > probes( files.size() );
+    if( nThreads == 0 ) nThreads = std::thread::hardware_concurrency();
+    nThreads = std::max< uint32_t >( 1,
+            std::min< size_t >( nThreads, files.size() ) );
 
-    LOG(ERROR) << "unrecognised format: " << fileName;
+    std::atomic< size_t > next( 0 );
+    auto worker = [&](){
+        for( size_t i = next++; i < files.size(); i = next++ ){
+            Probe &probe = probes[ i ];
+            statFile( files[ i ], probe.size, probe.mtime );
+            auto c = cached.find( files[ i ] );
+            if( c != cached.end() && c->second.size == probe.size
+             && c->second.mtime == probe.mtime ){
+                probe.kind = c->second.kind;
+                if( probe.kind == PROBE_IMAGE ){
+                    probe.source = std::make_shared< ImageSource >(
+                            files[ i ], _imageCache );
+                }
+                continue;
+            }
+            probe.source = TileSource::open( files[ i ], _imageCache );
+            if( dynamic_cast< ImageSource * >( probe.source.get() ) ){
+                probe.kind = PROBE_IMAGE;
+            }
+        }
+    };
+
+    std::vector< std::thread > threads;
+    for( uint32_t i = 1; i < nThreads; ++i ) threads.emplace_back( worker );
+    worker();
+    for( auto &thread : threads ) thread.join();
+
+    // register the sources in the order given
+    for( size_t i = 0; i < files.size(); ++i ){
+        std::shared_ptr< TileSource > &source = probes[ i ].source;
+        if(! source ){
+            LOG( ERROR ) << "unrecognised format: " << files[ i ];
+            continue;
+        }
+        if(! source->nTiles ) continue;
+        CHECK( (uint64_t)_nTiles + source->nTiles <= UINT32_MAX )
+            << "too many tiles adding " << files[ i ];
+        sources.push_back( Source{ nTiles, source->nTiles, source } );
+        if( source->nTiles != 1 ) singleTileSources = false;
+        _nTiles += source->nTiles;
+    }
+
+    if( _probeCache.empty() ) return;
+
+    // smt and smf files are opened regardless, so aren't recorded
+    for( size_t i = 0; i < files.size(); ++i ){
+        if( probes[ i ].source && probes[ i ].kind != PROBE_IMAGE ) continue;
+        probes[ i ].source.reset();
+        cached[ files[ i ] ] = probes[ i ];
+    }
+    std::ofstream file( _probeCache, std::ios::trunc );
+    if(! file.good() ){
+        LOG( WARN ) << "unable to write probe cache: " << _probeCache;
+        return;
+    }
+    file << "# smf_tools source probe cache: kind size mtime name\n";
+    for( auto &c : cached ){
+        file << c.second.kind << " " << c.second.size << " "
+             << c.second.mtime << " " << c.first << "\n";
+    }
 }
 
 
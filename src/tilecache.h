@@ -3,34 +3,160 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <deque>
+#include <unordered_set>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include <OpenImageIO/imagebuf.h>
 
+#include "tilelru.h"
+#include "tilesource.h"
+
 class TileCache
 {
     // member data
     uint32_t _nTiles = 0;
-    // FIXME this twin vector mapping can be turned into a pair or a tuple
-    std::vector< uint32_t > map;
-    std::vector< std::string > fileNames;
+
+    /// a source and where its tiles start
+    struct Source {
+        uint32_t first;     //!< index of the first tile of this source
+        uint32_t count;     //!< number of tiles in this source
+        //! shared by copies of the cache
+        std::shared_ptr< TileSource > source;
+    };
+    // sources in tile order, and whether every one holds a single tile
+    std::vector< Source > sources;
+    bool singleTileSources = true;
+    // see setProbeCache()
+    std::string _probeCache;
+
+    // decoded tiles, see setCacheBytes()
+    TileLRU _lru{ 256 << 20 };
+
+    // background decoding, see prefetch()
+    uint32_t _prefetchThreads = 0;
+    std::vector< std::thread > _prefetchWorkers;
+    std::deque< uint32_t > _prefetchQueue;
+    std::unordered_set< uint32_t > _prefetchQueued; //!< tiles in the queue
+    OpenImageIO::ImageSpec _prefetchSpec;
+    std::mutex _prefetchMutex;
+    std::condition_variable _prefetchWake;
+    bool _prefetchStop = false;
+
+    void prefetchWorker();
+    void stopPrefetch();
+
+    // image sources are read through this, see setImageCacheBytes()
+    OpenImageIO::ImageCache *_imageCache;
+
+    /// decode tile n to the size and format of spec at dest
+    bool readTile( const uint32_t n, const OpenImageIO::ImageSpec &spec,
+            uint8_t *dest );
+
+    /// find the source that holds tile n
+    /*  returns the position of the source in sources, and sets first to
+     *  the index of the first tile belonging to that source. Sources of
+     *  single tiles are indexed directly, otherwise this is a binary search.
+     */
+    size_t findSource( const uint32_t n, uint32_t &first ) const;
 
 public:
+    TileCache( );
+    ~TileCache();
+
     // data accesa
     const uint32_t &nTiles = _nTiles;
 
     // modifications
     void addSource( const std::string );
 
-    /// get a tile from the cache
-    /*
-     *
+    /// add many sources, probing their headers in parallel
+    /*  Directories are expanded to the files they contain in name order, and
+     *  names starting with '@' are manifests listing one source per line,
+     *  relative to the manifest. Smf files add the smt files they name.
+     *  nThreads of 0 uses one per core.
      */
+    void addSources( const std::vector< std::string > &fileNames,
+            uint32_t nThreads = 0 );
+
+    /// remember probe results in this file between runs
+    /*  Images and unrecognised files whose size and modification time match
+     *  the last run are added without being opened.
+     */
+    void setProbeCache( const std::string &fileName ){ _probeCache = fileName; }
+
+    /// get a tile from the cache
     std::unique_ptr< OpenImageIO::ImageBuf > getTile(const uint32_t n);
 
+    /// get many tiles in one contiguous block of memory
+    /*  Every tile is converted to the size and format of spec, tile k of the
+     *  request is found at k * spec.image_bytes() in the result. Tiles from
+     *  smt sources with a matching spec are decoded in place with coalesced
+     *  reads, tiles held in the decoded tile cache are copied from it.
+     */
+    std::vector< uint8_t > getTiles( const std::vector< uint32_t > &indices,
+            const OpenImageIO::ImageSpec &spec );
+
+    /// get many tiles, writing tile k of the request to dest[ k ]
+    /*  Tiles that miss the decoded tile cache are added to it unless keep
+     *  is false, for callers that read each tile once and would only evict
+     *  tiles that are used again.
+     */
+    void getTiles( const std::vector< uint32_t > &indices,
+            const OpenImageIO::ImageSpec &spec, uint8_t * const *dest,
+            bool keep = true );
+
+    /// set the memory budget for decoded tiles
+    /*  getTiles() keeps the tiles it decodes in a least recently used
+     *  cache of this many bytes, 256MiB by default, 0 disables it.
+     */
+    void setCacheBytes( size_t bytes ){ _lru.setBudget( bytes ); }
+
+    /// decode tiles on background threads ahead of their use
+    /*  Queues the tiles to be decoded to spec and added to the decoded tile
+     *  cache, so that a later getTiles() with the same spec finds them
+     *  there. Tiles already cached or queued are skipped, and a request
+     *  with a new spec replaces whatever is still queued. The queue holds
+     *  no more tiles than the cache does, the rest of a request is dropped
+     *  rather than evict tiles prefetched before it. Does nothing when the
+     *  cache is disabled.
+     */
+    void prefetch( const std::vector< uint32_t > &indices,
+            const OpenImageIO::ImageSpec &spec );
+
+    /// set the memory ceiling for image sources
+    /*  Image sources are read a tile at a time through OpenImageIO's shared
+     *  ImageCache, which keeps at most this many bytes of them in memory.
+     *  The cache is shared by every TileCache in the process.
+     */
+    void setImageCacheBytes( size_t bytes );
+
+    /// number of background decoding threads, 0 uses one per core
+    void setPrefetchThreads( uint32_t n ){ stopPrefetch(); _prefetchThreads = n; }
+
+    /// hit, miss and eviction counts of the decoded tile cache
+    TileLRU::Stats cacheStats() const { return _lru.stats(); }
+
+    /// get the encoded dxt1 data of a tile
+    /*  Copies the four level dxt1 mip chain of a tile without decoding it.
+     *  Only dxt1 smt sources and dxt1 dds images of the requested tile size
+     *  are able to provide this, returns false for everything else.
+     */
+    bool getTileDXT1( const uint32_t n, const uint32_t tileSize,
+            std::vector< uint8_t > &blocks );
+
     TileCache &operator=( const TileCache& rhs ){
+        stopPrefetch();
+        _prefetchThreads = rhs._prefetchThreads;
         _nTiles = rhs._nTiles;
-        map = rhs.map;
-        fileNames = rhs.fileNames;
+        sources = rhs.sources;
+        singleTileSources = rhs.singleTileSources;
+        _probeCache = rhs._probeCache;
+        _imageCache = rhs._imageCache;
+        _lru.clear();
+        _lru.setBudget( rhs._lru.budget() );
         return *this;
     }
 };
@@ -1,4 +1,7 @@
 #include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
@@ -7,6 +10,7 @@
 
 #include "smf_tools.h"
 #include "tiledimage.h"
+#include "smt.h"
 #include "util.h"
 
 OIIO_NAMESPACE_USING;
@@ -49,6 +53,7 @@ void
 TiledImage::setTSpec( ImageSpec spec )
 {
     _tSpec = spec;
+    updateLOD();
 }
 
 void
@@ -57,12 +62,32 @@ TiledImage::setTileSize( uint32_t inWidth, uint32_t inHeight )
     CHECK( inWidth > 0 ) << "width(" << inWidth << ") must be greater than zero";
     CHECK( inHeight > 0 ) << "height(" << inHeight << ") must be greater than zero";
     _tSpec = ImageSpec( inWidth, inHeight, _tSpec.nchannels, _tSpec.format );
+    updateLOD();
 }
 
 void
 TiledImage::setOverlap( uint32_t overlap )
 {
     _overlap = overlap;
+    updateLOD();
+}
+
+void
+TiledImage::setLOD( uint32_t lod )
+{
+    CHECK( lod < SMT::nMips ) << "lod(" << lod << ") must be less than " << SMT::nMips;
+    CHECK( (tSpec.width >> lod) && (tSpec.height >> lod) )
+        << "lod(" << lod << ") leaves no pixels in a tile";
+    _lod = lod;
+    updateLOD();
+}
+
+void
+TiledImage::updateLOD()
+{
+    _lodSpec = ImageSpec( tSpec.width >> lod, tSpec.height >> lod,
+            tSpec.nchannels, tSpec.format );
+    _lodOverlap = overlap >> lod;
 }
 
 void
@@ -90,50 +115,124 @@ TiledImage::squareFromCache( )
 uint32_t
 TiledImage::getWidth()
 {
-    return tileMap.width * (tSpec.width - overlap) + overlap;
+    return tileMap.width * (_lodSpec.width - _lodOverlap) + _lodOverlap;
 }
 
 uint32_t
 TiledImage::getHeight()
 {
-    return tileMap.height * (tSpec.height - overlap) + overlap;
+    return tileMap.height * (_lodSpec.height - _lodOverlap) + _lodOverlap;
+}
+
+std::vector< uint32_t >
+TiledImage::regionIndices( const ROI &roi )
+{
+    // the unique tiles under the region, in traversal order
+    uint32_t mxEnd = std::min( (roi.xend - 1) / (_lodSpec.width - _lodOverlap) + 1, tileMap.width );
+    uint32_t myEnd = std::min( (roi.yend - 1) / (_lodSpec.height - _lodOverlap) + 1, tileMap.height );
+    std::vector< uint32_t > indices;
+    std::unordered_set< uint32_t > seen;
+    for( uint32_t my = roi.ybegin / (_lodSpec.height - _lodOverlap); my < myEnd; ++my ){
+        for( uint32_t mx = roi.xbegin / (_lodSpec.width - _lodOverlap); mx < mxEnd; ++mx ){
+            uint32_t index = tileMap( mx, my );
+            if( index < tileCache.nTiles && seen.insert( index ).second ){
+                indices.push_back( index );
+            }
+        }
+    }
+    return indices;
+}
+
+void
+TiledImage::prefetchRegion( const ROI &roi )
+{
+    tileCache.prefetch( regionIndices( roi ), _lodSpec );
 }
 
 std::unique_ptr< ImageBuf >
 TiledImage::getRegion(
     const ROI &roi )
+{
+    std::unique_ptr< ImageBuf > outBuf( new ImageBuf );
+    getRegion( roi, *outBuf );
+#ifdef DEBUG_IMG
+    outBuf->write( "TiledImage.getRegion.tif", "tif" );
+#endif
+    return outBuf;
+}
+
+void
+TiledImage::getRegion(
+    const ROI &roi, ImageBuf &out )
 {
     DLOG( INFO ) << "source window "
         << "(" << roi.xbegin << ", " << roi.ybegin << ")"
       << "->(" << roi.xend   << ", " << roi.yend   << ")";
 
-    ImageSpec outSpec( roi.width(), roi.height(), 4, TypeDesc::UINT8 );
-
-    std::unique_ptr< ImageBuf > outBuf( new ImageBuf( outSpec ) );
-    //outBuf->write( "TiledImage_getRegion_outBuf.tif", "tif" );
+    // the region is in the pixel format of the tiles
+    ImageSpec outSpec( roi.width(), roi.height(), _lodSpec.nchannels, _lodSpec.format );
+    const ImageSpec &spec = out.spec();
+    if(! out.initialized() || spec.width != outSpec.width
+     || spec.height != outSpec.height || spec.nchannels != outSpec.nchannels
+     || spec.format != outSpec.format || spec.x || spec.y ){
+        out.reset( outSpec );
+    }
+    ImageBuf *outBuf = &out;
+
+    // A region covering exactly one tile is decoded straight into the
+    // output, skipping the intermediate tiles and the copy windows.
+    uint32_t xStride = _lodSpec.width - _lodOverlap;
+    uint32_t yStride = _lodSpec.height - _lodOverlap;
+    if( roi.width() == _lodSpec.width && roi.height() == _lodSpec.height
+     && roi.xbegin % xStride == 0 && roi.ybegin % yStride == 0 ){
+        uint32_t index = tileMap( roi.xbegin / xStride, roi.ybegin / yStride );
+        if( index < tileCache.nTiles ){
+            // each output tile reads its own tile once, so only prefetched
+            // tiles are worth keeping in the cache
+            uint8_t *dest = (uint8_t *)outBuf->localpixels();
+            tileCache.getTiles( { index }, _lodSpec, &dest, false );
+        }
+        else ImageBufAlgo::zero( *outBuf );
+        return;
+    }
 
     //current point of interest
     uint32_t ix = roi.xbegin;
     uint32_t iy = roi.ybegin;
-    static uint32_t index_p = INT_MAX;
     ROI cw{0,0,0,0,0,1,0,4}; // copy window
+
+    // windows are copied as raw rows between the tiles and the output
+    size_t pixelBytes = _lodSpec.pixel_bytes();
+    size_t tileStride = pixelBytes * _lodSpec.width;
+    size_t outStride = pixelBytes * outSpec.width;
+    uint8_t *outPixels = (uint8_t *)outBuf->localpixels();
+
+    // The tiles under the region are decoded up front in one request, so
+    // that the tile cache can coalesce the reads and serve repeats.
+    std::vector< uint8_t > arena;
+    std::unordered_map< uint32_t, size_t > slots;
+    {
+        std::vector< uint32_t > indices = regionIndices( roi );
+        for( size_t k = 0; k < indices.size(); ++k ) slots[ indices[ k ] ] = k;
+        if(! indices.empty() ) arena = tileCache.getTiles( indices, _lodSpec );
+    }
     while( true ){
          DLOG( INFO ) << "Point of interest (" << ix << ", " << iy << ")";
 
         //determine the tile under the point of interest
-        uint32_t mx = ix / (tSpec.width - overlap);
-        uint32_t my = iy / (tSpec.height - overlap);
+        uint32_t mx = ix / (_lodSpec.width - _lodOverlap);
+        uint32_t my = iy / (_lodSpec.height - _lodOverlap);
 
         //determine the top left corner of the copy window
-        cw.xbegin = ix - mx * (tSpec.width - overlap);
-        cw.ybegin = iy - my * (tSpec.height - overlap);
+        cw.xbegin = ix - mx * (_lodSpec.width - _lodOverlap);
+        cw.ybegin = iy - my * (_lodSpec.height - _lodOverlap);
 
         //determine the bottom right corner of the copy window
-        if( roi.xend / (tSpec.width - overlap) > mx ) cw.xend = tSpec.width;
-        else cw.xend = roi.xend - mx * (tSpec.width - overlap);
+        if( roi.xend / (_lodSpec.width - _lodOverlap) > mx ) cw.xend = _lodSpec.width;
+        else cw.xend = roi.xend - mx * (_lodSpec.width - _lodOverlap);
 
-        if( roi.yend / (tSpec.height - overlap) > my ) cw.yend = tSpec.height;
-        else cw.yend = roi.yend - my * (tSpec.height - overlap);
+        if( roi.yend / (_lodSpec.height - _lodOverlap) > my ) cw.yend = _lodSpec.height;
+        else cw.yend = roi.yend - my * (_lodSpec.height - _lodOverlap);
 
          DLOG( INFO ) << "copy window "
              << "(" << cw.xbegin << ", " << cw.ybegin << ")"
@@ -147,28 +246,19 @@ TiledImage::getRegion(
         uint32_t dy = iy - roi.ybegin;
         DLOG( INFO ) << "Paste position: " << dx << "x" << dy;
 
-        //Optimisation: exact copy of previous tile test
+        // tiles out of range are left blank
         uint32_t index = tileMap(mx, my);
-        if( index != index_p ){
-            // create blank tile if index is out of range
-            if( index >= tileCache.nTiles ){
-                currentTile.reset( new OpenImageIO::ImageBuf( tSpec ) );
-            } else {
-                currentTile = tileCache.getTile(index);
-                // possibility exists that the tile cache will give us a tile that
-                // has dimensions other than expected. so lets check and scale.
-                currentTile = fix_scale( std::move( currentTile ), tSpec );
-                // its possible that the tile retrieved has different channels
-                // than the tiledImage spec
-                currentTile = fix_channels( std::move( currentTile ), tSpec );
-            }
-            index_p = index;
-        }
-        if( currentTile ){
-            //copy pixel data from source tile to dest
-            ImageBufAlgo::paste( *outBuf, dx, dy, 0, 0, *currentTile, cw );
-            //outBuf->write( "TiledImage_getRegion_outBuf_paste.tif", "tif");
+        const uint8_t *tile = nullptr;
+        if( index < tileCache.nTiles ){
+            tile = arena.data() + _lodSpec.image_bytes() * slots[ index ]
+                + tileStride * cw.ybegin + pixelBytes * cw.xbegin;
         }
+        //copy pixel data from source tile to dest, clipped to the region as
+        //overlapping windows may reach past it
+        uint32_t width = std::min< uint32_t >( cw.width(), roi.width() - dx );
+        uint32_t height = std::min< uint32_t >( cw.height(), roi.height() - dy );
+        blit( tile, tileStride, outPixels + outStride * dy + pixelBytes * dx,
+                outStride, pixelBytes * width, height );
 
         //determine the next point of interest
         ix += cw.width();
@@ -181,10 +271,6 @@ TiledImage::getRegion(
             }
         }
     }
-#ifdef DEBUG_IMG
-    outBuf->write( "TiledImage.getRegion.tif", "tif" );
-#endif
-    return std::move( outBuf );
 }
 
 std::unique_ptr< ImageBuf >
@@ -200,7 +286,7 @@ std::unique_ptr< ImageBuf >
 TiledImage::getTile( const uint32_t idx )
 {
     auto retval = tileCache.getTile( idx );
-    retval = fix_channels( std::move( currentTile ), tSpec );
-    retval = fix_scale( std::move( currentTile ), tSpec );
+    retval = fix_channels( std::move( retval ), _lodSpec );
+    retval = fix_scale( std::move( retval ), _lodSpec );
     return retval;
 }
@@ -11,10 +11,18 @@
 class TiledImage
 {
     // == data members ==
-    std::unique_ptr< OpenImageIO::ImageBuf > currentTile; //!<
     OpenImageIO::ImageSpec _tSpec =
             OpenImageIO::ImageSpec( 32, 32, 4, OpenImageIO::TypeDesc::UINT8 );
     uint32_t _overlap = 0; //!< used for when tiles share border pixels
+    uint32_t _lod = 0;     //!< see setLOD()
+
+    //! tile spec and overlap at the current level of detail
+    OpenImageIO::ImageSpec _lodSpec = _tSpec;
+    uint32_t _lodOverlap = 0;
+    void updateLOD();
+
+    //! unique tile indices under a region, in the order they are visited
+    std::vector< uint32_t > regionIndices( const OpenImageIO::ROI & );
 
 public:
     TileMap tileMap; //!< tile map
@@ -32,6 +40,13 @@ public:
     void setTileMap( TileMap tileMap );
     void setOverlap( uint32_t overlap );
 
+    /// Read the image at a power of two reduction
+    /*  At level lod the image and its tiles are 2^lod times smaller in each
+     *  direction, regions are in those reduced coordinates. Smt tiles are
+     *  read from their stored mips, so lod may be up to SMT::nMips - 1.
+     */
+    void setLOD( uint32_t lod );
+
     void mapFromCSV( std::string );
 
     /// == Generation ==
@@ -41,18 +56,32 @@ public:
     // read only references
     const OpenImageIO::ImageSpec &tSpec = _tSpec;
     const uint32_t &overlap = _overlap;
+    const uint32_t &lod = _lod;
 
     // access methods
     uint32_t getWidth();
     uint32_t getHeight();
 
     /// Get pixel region
-    /*  TODO
-     *
+    /*  Holds no state between calls, so regions may be fetched from several
+     *  threads at once.
      */
     std::unique_ptr< OpenImageIO::ImageBuf > getRegion(
             const OpenImageIO::ROI & );
 
+    /// Get pixel region into the caller's buffer
+    /*  out is only reallocated when it doesn't already hold a region of the
+     *  same size and format, so a buffer reused between calls costs no
+     *  allocation.
+     */
+    void getRegion( const OpenImageIO::ROI &, OpenImageIO::ImageBuf &out );
+
+    /// Decode the tiles under a region in the background
+    /*  The tiles are handed to the tile cache's prefetch threads, so that a
+     *  later getRegion() over the same area does not wait on the sources.
+     */
+    void prefetchRegion( const OpenImageIO::ROI & );
+
     /// Get image Region, relative coords.
     /*  TODO
      *
@@ -0,0 +1,99 @@
+#include "tilelru.h"
+
+TileLRU::TileLRU( size_t budget ) :
+    _budget( budget ), _hits( 0 ), _misses( 0 ), _evictions( 0 )
+{ }
+
+void
+TileLRU::setBudget( size_t bytes )
+{
+    _budget = bytes;
+    for( auto &s : _shards ){
+        std::lock_guard< std::mutex > lock( s.mutex );
+        trim( s );
+    }
+}
+
+TileLRU::Pixels
+TileLRU::find( uint64_t key, uint64_t signature )
+{
+    Shard &s = shard( key );
+    std::lock_guard< std::mutex > lock( s.mutex );
+
+    auto i = s.entries.find( key );
+    if( i == s.entries.end() || i->second->signature != signature ){
+        ++_misses;
+        return nullptr;
+    }
+    ++_hits;
+    s.order.splice( s.order.begin(), s.order, i->second );
+    return i->second->pixels;
+}
+
+bool
+TileLRU::contains( uint64_t key, uint64_t signature )
+{
+    Shard &s = shard( key );
+    std::lock_guard< std::mutex > lock( s.mutex );
+    auto i = s.entries.find( key );
+    return i != s.entries.end() && i->second->signature == signature;
+}
+
+void
+TileLRU::insert( uint64_t key, uint64_t signature, Pixels pixels )
+{
+    if(! _budget || ! pixels ) return;
+
+    Shard &s = shard( key );
+    std::lock_guard< std::mutex > lock( s.mutex );
+
+    auto i = s.entries.find( key );
+    if( i != s.entries.end() ){
+        s.bytes -= i->second->pixels->size();
+        s.order.erase( i->second );
+        s.entries.erase( i );
+    }
+
+    s.bytes += pixels->size();
+    s.order.push_front( Entry{ key, signature, std::move( pixels ) } );
+    s.entries[ key ] = s.order.begin();
+    trim( s );
+}
+
+void
+TileLRU::clear()
+{
+    for( auto &s : _shards ){
+        std::lock_guard< std::mutex > lock( s.mutex );
+        s.order.clear();
+        s.entries.clear();
+        s.bytes = 0;
+    }
+}
+
+TileLRU::Stats
+TileLRU::stats() const
+{
+    Stats stats;
+    stats.hits = _hits;
+    stats.misses = _misses;
+    stats.evictions = _evictions;
+    for( auto &s : _shards ){
+        std::lock_guard< std::mutex > lock( s.mutex );
+        stats.bytes += s.bytes;
+    }
+    return stats;
+}
+
+void
+TileLRU::trim( Shard &s )
+{
+    size_t share = _budget / _nShards;
+    while( s.bytes > share && ! s.order.empty() ){
+        const Entry &last = s.order.back();
+        s.bytes -= last.pixels->size();
+        s.entries.erase( last.key );
+        s.order.pop_back();
+        ++_evictions;
+    }
+}
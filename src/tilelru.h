@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/// Least recently used cache of decoded tiles within a byte budget
+/*  Tiles are identified by a 64 bit key and stored along with a signature
+ *  of the pixel format they were decoded to, a lookup with a different
+ *  signature misses. The cache is split into shards each with their own
+ *  lock and an equal share of the budget, so that it can be filled and
+ *  read from several threads at once.
+ */
+class TileLRU
+{
+public:
+    typedef std::shared_ptr< const std::vector< uint8_t > > Pixels;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t bytes = 0;     //!< bytes of pixels currently held
+    };
+
+    explicit TileLRU( size_t budget = 0 );
+
+    /// set the byte budget, evicting as needed, 0 disables the cache
+    void setBudget( size_t bytes );
+    size_t budget() const { return _budget; }
+
+    /// get the pixels of a tile, nullptr on a miss
+    Pixels find( uint64_t key, uint64_t signature );
+
+    /// add the pixels of a tile, replacing any previous entry
+    void insert( uint64_t key, uint64_t signature, Pixels pixels );
+
+    /// test for a tile without counting a hit or miss or touching its age
+    bool contains( uint64_t key, uint64_t signature );
+
+    /// drop every tile, the counters are kept
+    void clear();
+
+    Stats stats() const;
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint64_t signature;
+        Pixels pixels;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list< Entry > order;   //!< most recently used first
+        std::unordered_map< uint64_t, std::list< Entry >::iterator > entries;
+        size_t bytes = 0;
+    };
+
+    static const size_t _nShards = 16;
+    Shard _shards[ _nShards ];
+    size_t _budget = 0;
+
+    std::atomic< uint64_t > _hits;
+    std::atomic< uint64_t > _misses;
+    std::atomic< uint64_t > _evictions;
+
+    Shard &shard( uint64_t key ){ return _shards[ key % _nShards ]; }
+    //! evict from the back of a locked shard until it fits its share
+    void trim( Shard &shard );
+};
@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <map>
+#include <OpenImageIO/imageio.h>
+#include <OpenImageIO/imagebuf.h>
+#include <elog.h>
+
+#include "smf_tools.h"
+#include "util.h"
+#include "smt.h"
+#include "smf.h"
+#include "tilesource.h"
+
+OIIO_NAMESPACE_USING;
+
+// Read the four level mip chain from a square dxt1 compressed dds image,
+// setting size to its width
+static bool
+readDDS_DXT1( const std::string &fileName, uint32_t &size,
+        std::vector< uint8_t > &blocks )
+{
+    std::ifstream file( fileName, std::ios::binary );
+    if(! file.good() ) return false;
+
+    // magic, and the parts of the 124 byte header we care about
+    uint32_t header[ 32 ];
+    file.read( (char *)header, sizeof( header ) );
+    if( file.gcount() != sizeof( header ) ) return false;
+    if( memcmp( header, "DDS ", 4 ) ) return false;
+
+    uint32_t height = header[ 3 ];
+    uint32_t width = header[ 4 ];
+    uint32_t mipMapCount = header[ 7 ];
+    if( memcmp( &header[ 21 ], "DXT1", 4 ) ) return false;
+    // the blocks are kept by the caller, so only tile sized images qualify
+    if( width != height || width > 1024 || mipMapCount < 4 ) return false;
+
+    uint32_t bytes = 0;
+    for( uint32_t mip = width; mip > width >> 4; mip >>= 1 ){
+        bytes += (mip * mip) / 2;
+    }
+    blocks.resize( bytes );
+    file.read( (char *)blocks.data(), bytes );
+    if( file.gcount() != bytes ){
+        blocks.clear();
+        return false;
+    }
+    size = width;
+    return true;
+}
+
+// TileSource
+// ==========
+std::shared_ptr< TileSource >
+TileSource::open( const std::string &fileName, ImageCache *imageCache )
+{
+    if( SMT::test( fileName ) ){
+        SMT *smt = SMT::open( fileName );
+        if(! smt ) return nullptr;
+        return std::make_shared< SMTSource >( smt );
+    }
+
+    if( SMF::test( fileName ) ){
+        std::unique_ptr< SMF > smf( SMF::open( fileName ) );
+        std::vector< std::string > smtFiles;
+        for( auto i : smf->getSMTList() ) smtFiles.push_back( i.second );
+        return std::make_shared< SMFSource >( fileName, smtFiles, imageCache );
+    }
+
+    // opening an image only reads its header
+    ImageInput *image = nullptr;
+    if( (image = ImageInput::open( fileName )) ){
+        image->close();
+        delete image;
+        return std::make_shared< ImageSource >( fileName, imageCache );
+    }
+
+    return nullptr;
+}
+
+bool
+TileSource::getTiles( const std::vector< uint32_t > &indices,
+        const ImageSpec &spec, uint8_t * const *dest )
+{
+    for( size_t k = 0; k < indices.size(); ++k ){
+        std::unique_ptr< ImageBuf > tile = getTile( indices[ k ] );
+        if(! tile || ! tile->initialized() ) return false;
+        tile = fix_scale( std::move( tile ), spec );
+        tile = fix_channels( std::move( tile ), spec );
+        if(! tile->get_pixels( 0, spec.width, 0, spec.height, 0, 1,
+                spec.format, dest[ k ] ) ) return false;
+    }
+    return true;
+}
+
+// SMTSource
+// =========
+SMTSource::SMTSource( SMT *smt ) :
+    TileSource( smt->fileName ), _smt( smt )
+{
+    _nTiles = smt->nTiles;
+    // mapped up front so that any thread can read from it, tilemaps
+    // reference tiles in arbitrary order.
+    _smt->mapFile( SMT::ADVICE_RANDOM );
+}
+
+SMTSource::~SMTSource() { }
+
+std::unique_ptr< ImageBuf >
+SMTSource::getTile( const uint32_t n )
+{
+    return _smt->getTile( n );
+}
+
+bool
+SMTSource::getTiles( const std::vector< uint32_t > &indices,
+        const ImageSpec &spec, uint8_t * const *dest )
+{
+    // tiles that need no conversion are decoded straight into place, from
+    // whichever stored mip is the requested size.
+    for( uint32_t mip = 0; mip < SMT::nMips; ++mip ){
+        ImageSpec mipSpec = _smt->mipSpec( mip );
+        if( mipSpec.width == spec.width && mipSpec.height == spec.height
+         && mipSpec.nchannels == spec.nchannels && mipSpec.format == spec.format ){
+            _smt->getTiles( indices, dest, mip );
+            return true;
+        }
+    }
+    return TileSource::getTiles( indices, spec, dest );
+}
+
+bool
+SMTSource::getTileDXT1( const uint32_t n, const uint32_t tileSize,
+        std::vector< uint8_t > &blocks )
+{
+    if( _smt->tileType != 1 || _smt->tileSize != tileSize ) return false;
+    const uint8_t *raw = _smt->getTileRaw( n );
+    blocks.assign( raw, raw + _smt->tileBytes );
+    return true;
+}
+
+// ImageSource
+// ===========
+ImageSource::ImageSource( const std::string &fileName, ImageCache *imageCache ) :
+    TileSource( fileName ), _imageCache( imageCache )
+{
+    _nTiles = 1;
+}
+
+bool
+ImageSource::readLevel( const ImageSpec &spec, uint8_t *dest )
+{
+    // mip levels shrink, so stop at the first one smaller than the tile
+    ustring name( fileName );
+    ImageSpec level;
+    for( int mip = 0; _imageCache->get_imagespec( name, level, 0, mip ); ++mip ){
+        if( level.width < spec.width || level.height < spec.height ) break;
+        if( level.width != spec.width || level.height != spec.height ) continue;
+        if( level.nchannels != spec.nchannels ) break;
+        return _imageCache->get_pixels( name, 0, mip,
+                level.x, level.x + level.width, level.y, level.y + level.height,
+                0, 1, spec.format, dest );
+    }
+    return false;
+}
+
+std::unique_ptr< ImageBuf >
+ImageSource::getTile( const uint32_t )
+{
+    std::unique_ptr< ImageBuf > outBuf( new ImageBuf( fileName, _imageCache ) );
+    outBuf->read();
+    return outBuf;
+}
+
+bool
+ImageSource::getTiles( const std::vector< uint32_t > &indices,
+        const ImageSpec &spec, uint8_t * const *dest )
+{
+    for( size_t k = 0; k < indices.size(); ++k ){
+        if( readLevel( spec, dest[ k ] ) ) continue;
+        if(! TileSource::getTiles( { indices[ k ] }, spec, &dest[ k ] ) ){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+ImageSource::getTileDXT1( const uint32_t, const uint32_t tileSize,
+        std::vector< uint8_t > &blocks )
+{
+    // the file is only looked at once, images that aren't dxt1 dds keep
+    // no blocks
+    std::call_once( _ddsProbe, [this](){
+        readDDS_DXT1( fileName, _ddsSize, _ddsBlocks ); } );
+    if( _ddsBlocks.empty() || _ddsSize != tileSize ) return false;
+    blocks = _ddsBlocks;
+    return true;
+}
+
+// SMFSource
+// =========
+SMFSource::SMFSource( const std::string &fileName,
+        const std::vector< std::string > &smtFiles, ImageCache *imageCache ) :
+    TileSource( fileName )
+{
+    for( auto &smtFile : smtFiles ){
+        std::shared_ptr< TileSource > source = open( smtFile, imageCache );
+        if(! source ){
+            LOG( ERROR ) << "unrecognised format: " << smtFile
+                << " referenced by " << fileName;
+            continue;
+        }
+        if(! source->nTiles ) continue;
+        CHECK( (uint64_t)_nTiles + source->nTiles <= UINT32_MAX )
+            << "too many tiles adding " << smtFile;
+        _sources.push_back( source );
+        _first.push_back( _nTiles );
+        _nTiles += source->nTiles;
+    }
+}
+
+size_t
+SMFSource::find( const uint32_t n, uint32_t &local ) const
+{
+    size_t i = std::upper_bound( _first.begin(), _first.end(), n )
+        - _first.begin() - 1;
+    local = n - _first[ i ];
+    return i;
+}
+
+std::unique_ptr< ImageBuf >
+SMFSource::getTile( const uint32_t n )
+{
+    uint32_t local;
+    size_t i = find( n, local );
+    return _sources[ i ]->getTile( local );
+}
+
+bool
+SMFSource::getTiles( const std::vector< uint32_t > &indices,
+        const ImageSpec &spec, uint8_t * const *dest )
+{
+    // hand each smt its share of the request
+    struct Request {
+        std::vector< uint32_t > indices;
+        std::vector< uint8_t * > dest;
+    };
+    std::map< size_t, Request > requests;
+    for( size_t k = 0; k < indices.size(); ++k ){
+        uint32_t local;
+        Request &request = requests[ find( indices[ k ], local ) ];
+        request.indices.push_back( local );
+        request.dest.push_back( dest[ k ] );
+    }
+
+    for( auto &i : requests ){
+        if(! _sources[ i.first ]->getTiles( i.second.indices, spec,
+                i.second.dest.data() ) ) return false;
+    }
+    return true;
+}
+
+bool
+SMFSource::getTileDXT1( const uint32_t n, const uint32_t tileSize,
+        std::vector< uint8_t > &blocks )
+{
+    uint32_t local;
+    size_t i = find( n, local );
+    return _sources[ i ]->getTileDXT1( local, tileSize, blocks );
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <OpenImageIO/imagebuf.h>
+
+class SMT;
+
+/// A file providing a contiguous range of tiles
+/*  Tiles are numbered from zero within each source. Every implementation
+ *  may be read from several threads at once, so that parallel stages can
+ *  share one set of sources.
+ */
+class TileSource
+{
+protected:
+    std::string _fileName;
+    uint32_t _nTiles = 0;
+
+public:
+    explicit TileSource( const std::string &fileName ) : _fileName( fileName ) { }
+    TileSource( const TileSource & ) = delete;
+    TileSource &operator=( const TileSource & ) = delete;
+    virtual ~TileSource() { }
+
+    // read only references
+    const std::string &fileName = _fileName;
+    const uint32_t &nTiles = _nTiles;
+
+    /// identify a file by its header and open it
+    /*  smt and smf files are recognised by their magic, anything else is
+     *  offered to OpenImageIO and read through imageCache. Returns nullptr
+     *  when the file is none of these.
+     */
+    static std::shared_ptr< TileSource > open( const std::string &fileName,
+            OpenImageIO::ImageCache *imageCache );
+
+    /// get tile n in the size and format of the source
+    virtual std::unique_ptr< OpenImageIO::ImageBuf > getTile( const uint32_t n ) = 0;
+
+    /// decode many tiles to the size and format of spec
+    /*  Tile indices[ k ] is written to dest[ k ]. The default converts the
+     *  result of getTile(), implementations skip that where they can.
+     *  Returns false if any tile could not be read.
+     */
+    virtual bool getTiles( const std::vector< uint32_t > &indices,
+            const OpenImageIO::ImageSpec &spec, uint8_t * const *dest );
+
+    /// get the encoded dxt1 data of a tile
+    /*  Copies the four level dxt1 mip chain without decoding it, returns
+     *  false when the source has no such data for this tile size.
+     */
+    virtual bool getTileDXT1( const uint32_t, const uint32_t,
+            std::vector< uint8_t > & ){ return false; }
+};
+
+/// Tiles of an smt file
+/*  The file stays open and mapped for the life of the source. getTiles()
+ *  at half, quarter or eighth size reads the stored mips rather than
+ *  scaling.
+ */
+class SMTSource : public TileSource
+{
+    std::unique_ptr< SMT > _smt;
+
+public:
+    /// take ownership of an open smt
+    explicit SMTSource( SMT *smt );
+    ~SMTSource();
+
+    std::unique_ptr< OpenImageIO::ImageBuf > getTile( const uint32_t n ) override;
+    bool getTiles( const std::vector< uint32_t > &indices,
+            const OpenImageIO::ImageSpec &spec, uint8_t * const *dest ) override;
+    bool getTileDXT1( const uint32_t n, const uint32_t tileSize,
+            std::vector< uint8_t > &blocks ) override;
+};
+
+/// A single tile from an image file
+/*  Pixels are read through an OpenImageIO ImageCache as they are used, and
+ *  a mip level of the file already the requested size is read directly.
+ */
+class ImageSource : public TileSource
+{
+    OpenImageIO::ImageCache *_imageCache;
+
+    //! dxt1 mip chain of a dds file and its size, see getTileDXT1()
+    std::once_flag _ddsProbe;
+    uint32_t _ddsSize = 0;
+    std::vector< uint8_t > _ddsBlocks;
+
+    //! read a mip level the size of spec straight into dest
+    bool readLevel( const OpenImageIO::ImageSpec &spec, uint8_t *dest );
+
+public:
+    /// the file is not opened until its pixels are needed
+    ImageSource( const std::string &fileName,
+            OpenImageIO::ImageCache *imageCache );
+
+    std::unique_ptr< OpenImageIO::ImageBuf > getTile( const uint32_t n ) override;
+    bool getTiles( const std::vector< uint32_t > &indices,
+            const OpenImageIO::ImageSpec &spec, uint8_t * const *dest ) override;
+    bool getTileDXT1( const uint32_t n, const uint32_t tileSize,
+            std::vector< uint8_t > &blocks ) override;
+};
+
+/// The tiles of every smt file named by an smf, in order
+class SMFSource : public TileSource
+{
+    std::vector< std::shared_ptr< TileSource > > _sources;
+    std::vector< uint32_t > _first; //!< index of the first tile of each
+
+    //! position in _sources holding tile n, and n within it
+    size_t find( const uint32_t n, uint32_t &local ) const;
+
+public:
+    SMFSource( const std::string &fileName,
+            const std::vector< std::string > &smtFiles,
+            OpenImageIO::ImageCache *imageCache );
+
+    std::unique_ptr< OpenImageIO::ImageBuf > getTile( const uint32_t n ) override;
+    bool getTiles( const std::vector< uint32_t > &indices,
+            const OpenImageIO::ImageSpec &spec, uint8_t * const *dest ) override;
+    bool getTileDXT1( const uint32_t n, const uint32_t tileSize,
+            std::vector< uint8_t > &blocks ) override;
+};
@@ -1,10 +1,16 @@
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <sstream>
 #include <iostream>
 #include <list>
 
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#endif
+
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
 
@@ -72,6 +78,15 @@ expandString( const char *s )
     return result;
 }
 
+// rgba channels are taken from these source channels, -1 for those filled
+// from channelFill
+static const float channelFill[] = { 0, 0, 0, 1.0 };
+static void
+channelMap( const int nchannels, int *map )
+{
+    for( int i = 0; i < 4; ++i ) map[ i ] = i < nchannels ? i : -1;
+}
+
 std::unique_ptr< OpenImageIO::ImageBuf >
 fix_channels(
     std::unique_ptr< OpenImageIO::ImageBuf> && inBuf,
@@ -79,41 +94,54 @@ fix_channels(
 {
     OIIO_NAMESPACE_USING;
 
-    int map[] = { 0, 1, 2, 3 };
-    static const float fill[] = { 0, 0, 0, 1.0 };
+    int map[ 4 ];
 
     CHECK( inBuf ) << "nullptr passed to fix_channels()";
 
     // return a copy of the original if its the correct size.
     if( inBuf->spec().nchannels == spec.nchannels ) return std::move( inBuf );
-    if( inBuf->spec().nchannels < 4 ) map[3] = -1;
-    if( inBuf->spec().nchannels < 3 ) map[2] = -1;
-    if( inBuf->spec().nchannels < 2 ) map[1] = -1;
+    channelMap( inBuf->spec().nchannels, map );
 
     // Otherwise update channels to spec channels
     std::unique_ptr< OpenImageIO::ImageBuf > outBuf( new OpenImageIO::ImageBuf );
-    ImageBufAlgo::channels( *outBuf, *inBuf, spec.nchannels, map, fill );
+    ImageBufAlgo::channels( *outBuf, *inBuf, spec.nchannels, map, channelFill );
     return outBuf;
 }
 
+bool
+solid_colour( const OpenImageIO::ImageBuf &inBuf, uint8_t *rgba )
+{
+    int nchannels = inBuf.spec().nchannels;
+    std::vector< float > values( std::max( nchannels, 4 ) );
+    if(! OpenImageIO::ImageBufAlgo::isConstantColor( inBuf, values.data() ) ){
+        return false;
+    }
+    // the colour the tile has once fix_channels() makes it rgba
+    int map[ 4 ];
+    channelMap( nchannels, map );
+    for( int i = 0; i < 4; ++i ){
+        float v = map[ i ] < 0 ? channelFill[ i ] : values[ map[ i ] ];
+        v = std::min( std::max( v, 0.0f ), 1.0f );
+        rgba[ i ] = (uint8_t)(v * 255.0f + 0.5f);
+    }
+    return true;
+}
+
 void
 channels( OpenImageIO::ImageBuf *&sourceBuf, OpenImageIO::ImageSpec spec )
 {
     OIIO_NAMESPACE_USING;
-    int map[] = { 0, 1, 2, 3 };
-    float fill[] = { 0, 0, 0, 1.0 };
+    int map[ 4 ];
 
     CHECK( sourceBuf ) << "nullptr passed to channels()";
 
     // return a copy of the original if its the correct size.
     if( sourceBuf->spec().nchannels == spec.nchannels ) return;
-    if( sourceBuf->spec().nchannels < 4 ) map[3] = -1;
-    if( sourceBuf->spec().nchannels < 3 ) map[2] = -1;
-    if( sourceBuf->spec().nchannels < 2 ) map[1] = -1;
+    channelMap( sourceBuf->spec().nchannels, map );
 
     // Otherwise update channels to spec channels
     ImageBuf *tempBuf = new ImageBuf;
-    ImageBufAlgo::channels( *tempBuf, *sourceBuf, spec.nchannels, map, fill );
+    ImageBufAlgo::channels( *tempBuf, *sourceBuf, spec.nchannels, map, channelFill );
     sourceBuf->clear();
     delete sourceBuf;
     sourceBuf = tempBuf;
@@ -186,6 +214,134 @@ scale( OpenImageIO::ImageBuf *&sourceBuf, OpenImageIO::ImageSpec spec )
     sourceBuf = tempBuf;
 }
 
+// murmur3 style mixing of eight bytes at a time
+static inline uint64_t
+mix64( uint64_t h )
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void
+blit( const uint8_t *src, size_t srcStride, uint8_t *dst, size_t dstStride,
+        size_t rowBytes, uint32_t rows )
+{
+    if(! src ){
+        for( uint32_t y = 0; y < rows; ++y ) memset( dst + dstStride * y, 0, rowBytes );
+        return;
+    }
+
+    // whole rows of 32 pixel RGBA8 tiles are by far the most common, a
+    // constant size lets the copy be inlined as a few vector moves.
+    if( rowBytes == 128 ){
+        for( uint32_t y = 0; y < rows; ++y ){
+            memcpy( dst + dstStride * y, src + srcStride * y, 128 );
+        }
+        return;
+    }
+    for( uint32_t y = 0; y < rows; ++y ){
+        memcpy( dst + dstStride * y, src + srcStride * y, rowBytes );
+    }
+}
+
+uint64_t
+hash64( const void *data, size_t bytes, uint64_t seed )
+{
+    const uint64_t k1 = 0x87c37b91114253d5ULL;
+    const uint64_t k2 = 0x4cf5ad432745937fULL;
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = seed ^ (bytes * k1);
+
+    for( ; bytes >= 8; bytes -= 8, p += 8 ){
+        uint64_t k;
+        memcpy( &k, p, 8 );
+        k *= k1;
+        k = (k << 31) | (k >> 33);
+        k *= k2;
+        h ^= k;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+
+    uint64_t tail = 0;
+    for( size_t i = 0; i < bytes; ++i ) tail |= (uint64_t)p[ i ] << (i * 8);
+    h ^= mix64( tail ^ k2 );
+
+    return mix64( h );
+}
+
+// Four 64 bit lanes, each step adds the product of the low and high
+// halves of data ^ key to a lane, along with the data of its neighbour.
+// Every kilobyte the lanes are scrambled so that the products cannot
+// cancel out over long inputs.
+static const uint64_t hashKey[ 4 ] = {
+    0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL, 0x85ebca77c2b2ae63ULL };
+static const uint32_t hashPrime = 0x9e3779b1u;
+
+static inline void
+hashStripe( uint64_t *acc, const uint8_t *p, const uint64_t *key )
+{
+#if defined( __SSE2__ )
+    for( int i = 0; i < 4; i += 2 ){
+        __m128i a = _mm_loadu_si128( (const __m128i *)(acc + i) );
+        __m128i d = _mm_loadu_si128( (const __m128i *)(p + i * 8) );
+        __m128i k = _mm_loadu_si128( (const __m128i *)(key + i) );
+        __m128i dk = _mm_xor_si128( d, k );
+        __m128i product = _mm_mul_epu32( dk,
+                _mm_shuffle_epi32( dk, _MM_SHUFFLE( 0, 3, 0, 1 ) ) );
+        __m128i swapped = _mm_shuffle_epi32( d, _MM_SHUFFLE( 1, 0, 3, 2 ) );
+        a = _mm_add_epi64( a, _mm_add_epi64( product, swapped ) );
+        _mm_storeu_si128( (__m128i *)(acc + i), a );
+    }
+#else
+    uint64_t d[ 4 ];
+    memcpy( d, p, 32 );
+    for( int i = 0; i < 4; ++i ){
+        uint64_t dk = d[ i ] ^ key[ i ];
+        acc[ i ] += (dk & 0xffffffff) * (dk >> 32) + d[ i ^ 1 ];
+    }
+#endif
+}
+
+static inline void
+hashScramble( uint64_t *acc, const uint64_t *key )
+{
+    for( int i = 0; i < 4; ++i ){
+        acc[ i ] = ((acc[ i ] ^ (acc[ i ] >> 47)) ^ key[ i ]) * hashPrime;
+    }
+}
+
+Hash128
+hash128( const void *data, size_t bytes, uint64_t seed )
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t key[ 4 ], acc[ 4 ];
+    for( int i = 0; i < 4; ++i ){
+        key[ i ] = hashKey[ i ] + seed;
+        acc[ i ] = hashKey[ 3 - i ];
+    }
+
+    size_t n = bytes;
+    for( size_t stripe = 1; n >= 32; n -= 32, p += 32, ++stripe ){
+        hashStripe( acc, p, key );
+        if(! (stripe % 32) ) hashScramble( acc, key );
+    }
+    if( n ){
+        uint8_t tail[ 32 ] = { 0 };
+        memcpy( tail, p, n );
+        hashStripe( acc, tail, key );
+    }
+
+    Hash128 h;
+    h.low  = mix64( acc[ 0 ] ^ mix64( acc[ 2 ] + bytes ) );
+    h.high = mix64( acc[ 1 ] ^ mix64( acc[ 3 ] + seed ) ^ bytes );
+    return h;
+}
+
 void
 progressBar( std::string header, float goal, float current )
 {
@@ -56,6 +56,41 @@ std::unique_ptr< OpenImageIO::ImageBuf > fix_scale(
 void scale( OpenImageIO::ImageBuf *&sourceBuf,
         OpenImageIO::ImageSpec spec );
 
+/// Test whether an image is a single colour
+/*  Returns true if every pixel of the image is the same, and fills rgba
+ *  with that colour as four 8 bit channels, missing channels are filled
+ *  as fix_channels would.
+ */
+bool solid_colour( const OpenImageIO::ImageBuf &, uint8_t *rgba );
+
+/// Copy a window of rows between raw pixel buffers of the same format
+/*  rowBytes of each of rows rows are copied, with the rows of src and dst
+ *  srcStride and dstStride bytes apart. A null src clears the window.
+ */
+void blit( const uint8_t *src, size_t srcStride, uint8_t *dst,
+        size_t dstStride, size_t rowBytes, uint32_t rows );
+
+/// Fast non cryptographic 64 bit hash of a block of memory
+uint64_t hash64( const void *data, size_t bytes, uint64_t seed = 0 );
+
+/// 128 bit hash, see hash128()
+struct Hash128 {
+    uint64_t low = 0, high = 0;
+    bool operator==( const Hash128 &o ) const { return low == o.low && high == o.high; }
+    bool operator!=( const Hash128 &o ) const { return !(*this == o); }
+};
+
+/// use the low half of a Hash128 as the hash of a hash table
+struct Hash128Hasher {
+    size_t operator()( const Hash128 &h ) const { return h.low; }
+};
+
+/// Fast non cryptographic 128 bit hash of a block of memory
+/*  Consumes 32 bytes per step in the manner of xxh3, using SSE2 where it is
+ *  available. The result is the same with or without SSE2.
+ */
+Hash128 hash128( const void *data, size_t bytes, uint64_t seed = 0 );
+
 /// output a progress indicator
 void progressBar( std::string message, float goal, float progress );
 
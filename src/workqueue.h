@@ -0,0 +1,89 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+
+/// Bounded first in first out queue for handing work between threads
+/*  push() blocks while the queue is full, so a fast producer waits for its
+ *  consumers rather than buffering without limit. Once closed, pop() hands
+ *  out whatever is left and then returns false.
+ */
+template< typename T >
+class WorkQueue
+{
+    std::deque< T > _items;
+    size_t _capacity;
+    bool _closed = false;
+    std::mutex _mutex;
+    std::condition_variable _notFull, _notEmpty;
+
+public:
+    explicit WorkQueue( size_t capacity ) : _capacity( capacity ) { }
+
+    void push( T item ){
+        std::unique_lock< std::mutex > lock( _mutex );
+        _notFull.wait( lock, [this](){ return _items.size() < _capacity; } );
+        _items.push_back( std::move( item ) );
+        _notEmpty.notify_one();
+    }
+
+    /// take the oldest item, false once the queue is closed and empty
+    bool pop( T &item ){
+        std::unique_lock< std::mutex > lock( _mutex );
+        _notEmpty.wait( lock, [this](){ return _closed || ! _items.empty(); } );
+        if( _items.empty() ) return false;
+        item = std::move( _items.front() );
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+
+    /// no more items will be pushed
+    void close(){
+        std::lock_guard< std::mutex > lock( _mutex );
+        _closed = true;
+        _notEmpty.notify_all();
+    }
+};
+
+/// Bounded queue handing on items in sequence order
+/*  Items are pushed from any thread with a sequence number counting up from
+ *  zero, and pop() returns them in that order whichever arrives first.
+ *  push() blocks while its number is capacity or more past the next one to
+ *  be popped. The thread holding that next item can always push it, so the
+ *  queue cannot stall as long as every number is eventually pushed.
+ */
+template< typename T >
+class OrderedQueue
+{
+    std::map< uint64_t, T > _items;
+    uint64_t _next = 0;
+    size_t _capacity;
+    std::mutex _mutex;
+    std::condition_variable _space, _ready;
+
+public:
+    explicit OrderedQueue( size_t capacity ) : _capacity( capacity ) { }
+
+    void push( uint64_t seq, T item ){
+        std::unique_lock< std::mutex > lock( _mutex );
+        _space.wait( lock, [&](){ return seq < _next + _capacity; } );
+        _items.emplace( seq, std::move( item ) );
+        if( seq == _next ) _ready.notify_one();
+    }
+
+    /// wait for the next item in sequence and take it
+    T pop(){
+        std::unique_lock< std::mutex > lock( _mutex );
+        _ready.wait( lock, [this](){
+            return ! _items.empty() && _items.begin()->first == _next; } );
+        T item = std::move( _items.begin()->second );
+        _items.erase( _items.begin() );
+        ++_next;
+        _space.notify_all();
+        return item;
+    }
+};